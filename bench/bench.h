@@ -0,0 +1,97 @@
+
+#ifndef LOOTOPIA_BENCH_H
+#define LOOTOPIA_BENCH_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define BENCH_HISTOGRAM_SUB_BITS 5
+#define BENCH_HISTOGRAM_SUB_BUCKETS (1 << BENCH_HISTOGRAM_SUB_BITS)
+#define BENCH_HISTOGRAM_MAX_EXP 40
+#define BENCH_HISTOGRAM_BUCKETS \
+    (((BENCH_HISTOGRAM_MAX_EXP - BENCH_HISTOGRAM_SUB_BITS + 1) << BENCH_HISTOGRAM_SUB_BITS) + BENCH_HISTOGRAM_SUB_BUCKETS)
+#define BENCH_STATUS_LINE 256
+
+typedef struct {
+    uint64_t buckets[BENCH_HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t max;
+} bench_histogram_t;
+
+static inline uint64_t bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static inline size_t bench_bucket(uint64_t value) {
+    if (value < 2 * BENCH_HISTOGRAM_SUB_BUCKETS) {
+        return (size_t)value;
+    }
+    int exp = 63 - __builtin_clzll(value);
+    if (exp > BENCH_HISTOGRAM_MAX_EXP) {
+        return BENCH_HISTOGRAM_BUCKETS - 1;
+    }
+    return ((size_t)(exp - BENCH_HISTOGRAM_SUB_BITS) << BENCH_HISTOGRAM_SUB_BITS) +
+           (size_t)(value >> (exp - BENCH_HISTOGRAM_SUB_BITS));
+}
+
+static inline uint64_t bench_bucket_value(size_t index) {
+    if (index < 2 * BENCH_HISTOGRAM_SUB_BUCKETS) {
+        return index;
+    }
+    int exp = (int)(index >> BENCH_HISTOGRAM_SUB_BITS) + BENCH_HISTOGRAM_SUB_BITS - 1;
+    uint64_t mantissa = (index & (BENCH_HISTOGRAM_SUB_BUCKETS - 1)) + BENCH_HISTOGRAM_SUB_BUCKETS;
+    return mantissa << (exp - BENCH_HISTOGRAM_SUB_BITS);
+}
+
+static inline void bench_histogram_record(bench_histogram_t *hist, uint64_t value) {
+    hist->buckets[bench_bucket(value)]++;
+    hist->count++;
+    if (value > hist->max) {
+        hist->max = value;
+    }
+}
+
+static inline uint64_t bench_histogram_percentile(const bench_histogram_t *hist, double percentile) {
+    uint64_t rank = (uint64_t)(percentile / 100.0 * (double)hist->count);
+    uint64_t seen = 0;
+
+    for (size_t i = 0; i < BENCH_HISTOGRAM_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen > rank) {
+            return bench_bucket_value(i);
+        }
+    }
+    return hist->max;
+}
+
+static inline long bench_status_kb(pid_t pid, const char *field) {
+    char path[64];
+    char line[BENCH_STATUS_LINE];
+    long kb = -1;
+    size_t field_len = strlen(field);
+
+    if (pid > 0) {
+        snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    } else {
+        snprintf(path, sizeof(path), "%s", "/proc/self/status");
+    }
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        if (strncmp(line, field, field_len) == 0 && line[field_len] == ':') {
+            sscanf(line + field_len + 1, "%ld", &kb);
+            break;
+        }
+    }
+    fclose(file);
+    return kb;
+}
+
+#endif
@@ -0,0 +1,337 @@
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <librdkafka/rdkafka.h>
+#include <librdkafka/rdkafka_mock.h>
+#include <libwebsockets.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#ifndef LOOTOPIA_CORE_PATH
+#define LOOTOPIA_CORE_PATH "./Core"
+#endif
+
+#define E2E_TOPIC_IN "bench-in"
+#define E2E_TOPIC_OUT "bench-out"
+#define E2E_PARTITIONS 4
+#define E2E_BROKERS "3"
+#define E2E_SECRET "bench-secret"
+#define E2E_SENT_FIELD "\"sent_ns\":"
+#define E2E_MESSAGE_MAX 128
+#define E2E_DEFAULT_CLIENTS 100
+#define E2E_DEFAULT_MESSAGES 20000
+#define E2E_DEFAULT_RATE 5000
+#define E2E_DEFAULT_PORT 19090
+#define E2E_STARTUP_TIMEOUT_NS 20000000000ull
+#define E2E_WARMUP_TIMEOUT_NS 60000000000ull
+#define E2E_WARMUP_INTERVAL_NS 200000000ull
+#define E2E_DRAIN_TIMEOUT_NS 30000000000ull
+#define E2E_SERVICE_MS 10
+#define E2E_ERRSTR_LEN 512
+
+typedef struct {
+    rd_kafka_t *rk;
+    rd_kafka_topic_t *topic;
+    size_t messages;
+    double rate;
+    uint64_t elapsed_ns;
+} e2e_producer_t;
+
+typedef struct {
+    bench_histogram_t latency;
+    uint64_t received;
+    uint64_t warmup_received;
+    int established;
+    int failed;
+    bool measuring;
+} e2e_state_t;
+
+static e2e_state_t state;
+
+static long env_or(const char *name, long fallback) {
+    const char *value = getenv(name);
+    return value && value[0] ? strtol(value, NULL, 10) : fallback;
+}
+
+static void produce_one(e2e_producer_t *producer, uint64_t seq, uint64_t sent_ns) {
+    char message[E2E_MESSAGE_MAX];
+    int len = snprintf(message, sizeof(message), "{\"seq\":%llu,\"sent_ns\":%llu}",
+                       (unsigned long long)seq, (unsigned long long)sent_ns);
+
+    while (rd_kafka_produce(producer->topic, RD_KAFKA_PARTITION_UA, RD_KAFKA_MSG_F_COPY,
+                            message, (size_t)len, NULL, 0, NULL) != 0) {
+        if (rd_kafka_last_error() != RD_KAFKA_RESP_ERR__QUEUE_FULL) {
+            fprintf(stderr, "e2e_bench: produce failed: %s\n", rd_kafka_err2str(rd_kafka_last_error()));
+            return;
+        }
+        rd_kafka_poll(producer->rk, 1);
+    }
+    rd_kafka_poll(producer->rk, 0);
+}
+
+static void *produce_messages(void *arg) {
+    e2e_producer_t *producer = (e2e_producer_t *)arg;
+    uint64_t interval_ns = (uint64_t)(1e9 / producer->rate);
+    uint64_t start = bench_now_ns();
+
+    for (size_t i = 0; i < producer->messages; i++) {
+        uint64_t target = start + i * interval_ns;
+        uint64_t now = bench_now_ns();
+        if (now < target) {
+            struct timespec ts = {0, (long)(target - now)};
+            nanosleep(&ts, NULL);
+        }
+        produce_one(producer, i + 1, bench_now_ns());
+    }
+    rd_kafka_flush(producer->rk, 10000);
+    producer->elapsed_ns = bench_now_ns() - start;
+    return NULL;
+}
+
+static int client_callback(struct lws *wsi, enum lws_callback_reasons reason,
+                           void *user, void *in, size_t len) {
+    (void)user;
+    switch (reason) {
+        case LWS_CALLBACK_CLIENT_APPEND_HANDSHAKE_HEADER: {
+            unsigned char **p = (unsigned char **)in;
+            unsigned char *end = *p + len;
+            if (lws_add_http_header_by_name(wsi, (const unsigned char *)"authorization:",
+                                            (const unsigned char *)E2E_SECRET,
+                                            (int)strlen(E2E_SECRET), p, end)) {
+                return -1;
+            }
+            break;
+        }
+
+        case LWS_CALLBACK_CLIENT_ESTABLISHED:
+            state.established++;
+            break;
+
+        case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+            state.failed++;
+            break;
+
+        case LWS_CALLBACK_CLIENT_RECEIVE: {
+            uint64_t now = bench_now_ns();
+            const char *field = memmem(in, len, E2E_SENT_FIELD, strlen(E2E_SENT_FIELD));
+            uint64_t sent = field ? strtoull(field + strlen(E2E_SENT_FIELD), NULL, 10) : 0;
+            if (!state.measuring) {
+                state.warmup_received++;
+            } else if (sent > 0) {
+                state.received++;
+                bench_histogram_record(&state.latency, now > sent ? (now - sent) / 1000 : 0);
+            }
+            break;
+        }
+
+        default:
+            break;
+    }
+    return 0;
+}
+
+static const struct lws_protocols client_protocols[] = {
+    {.name = "lootopia-ws", .callback = client_callback},
+    LWS_PROTOCOL_LIST_TERM
+};
+
+static rd_kafka_t *create_mock_producer(const char **bootstraps) {
+    char errstr[E2E_ERRSTR_LEN];
+    rd_kafka_conf_t *conf = rd_kafka_conf_new();
+
+    if (rd_kafka_conf_set(conf, "test.mock.num.brokers", E2E_BROKERS, errstr, sizeof(errstr)) != RD_KAFKA_CONF_OK ||
+        rd_kafka_conf_set(conf, "linger.ms", "0", errstr, sizeof(errstr)) != RD_KAFKA_CONF_OK) {
+        fprintf(stderr, "e2e_bench: %s\n", errstr);
+        rd_kafka_conf_destroy(conf);
+        return NULL;
+    }
+    rd_kafka_t *rk = rd_kafka_new(RD_KAFKA_PRODUCER, conf, errstr, sizeof(errstr));
+    if (!rk) {
+        fprintf(stderr, "e2e_bench: %s\n", errstr);
+        rd_kafka_conf_destroy(conf);
+        return NULL;
+    }
+    rd_kafka_mock_cluster_t *mcluster = rd_kafka_handle_mock_cluster(rk);
+    rd_kafka_mock_topic_create(mcluster, E2E_TOPIC_IN, E2E_PARTITIONS, 1);
+    rd_kafka_mock_topic_create(mcluster, E2E_TOPIC_OUT, 1, 1);
+    *bootstraps = rd_kafka_mock_cluster_bootstraps(mcluster);
+    return rk;
+}
+
+static pid_t spawn_core(const char *path, const char *bootstraps, int port) {
+    char port_value[16];
+    pid_t pid = fork();
+
+    if (pid != 0) {
+        return pid;
+    }
+    snprintf(port_value, sizeof(port_value), "%d", port);
+    setenv("PORT", port_value, 1);
+    setenv("KAFKA_BROKERS", bootstraps, 1);
+    setenv("KAFKA_CONSUMER_TOPIC", E2E_TOPIC_IN, 1);
+    setenv("KAFKA_PRODUCER_TOPIC", E2E_TOPIC_OUT, 1);
+    setenv("KAFKA_GROUP_ID", "lootopia-bench", 1);
+    setenv("WEBSOCKET_SERVICE_SECRET", E2E_SECRET, 1);
+    if (!getenv("MSG_QUEUE_CAP")) {
+        setenv("MSG_QUEUE_CAP", "65536", 1);
+    }
+    if (!getenv("KAFKA_POLL")) {
+        setenv("KAFKA_POLL", "100", 1);
+    }
+    int devnull = open("/dev/null", O_WRONLY);
+    if (devnull >= 0) {
+        dup2(devnull, STDOUT_FILENO);
+        close(devnull);
+    }
+    execl(path, path, (char *)NULL);
+    perror("e2e_bench: exec Core");
+    _exit(127);
+}
+
+static bool wait_for_port(int port) {
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons((uint16_t)port)};
+    uint64_t deadline = bench_now_ns() + E2E_STARTUP_TIMEOUT_NS;
+
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    while (bench_now_ns() < deadline) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        bool open = fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (open) {
+            return true;
+        }
+        usleep(100000);
+    }
+    return false;
+}
+
+static bool connect_clients(struct lws_context *context, int port, int clients) {
+    struct lws_client_connect_info info;
+    uint64_t deadline = bench_now_ns() + E2E_STARTUP_TIMEOUT_NS;
+
+    for (int i = 0; i < clients; i++) {
+        memset(&info, 0, sizeof(info));
+        info.context = context;
+        info.address = "127.0.0.1";
+        info.host = info.address;
+        info.origin = info.address;
+        info.port = port;
+        info.path = "/";
+        lws_client_connect_via_info(&info);
+    }
+    while (state.established + state.failed < clients && bench_now_ns() < deadline) {
+        lws_service(context, E2E_SERVICE_MS);
+    }
+    return state.established == clients;
+}
+
+static bool warm_up(struct lws_context *context, e2e_producer_t *producer) {
+    uint64_t deadline = bench_now_ns() + E2E_WARMUP_TIMEOUT_NS;
+    uint64_t next = 0;
+
+    while (state.warmup_received == 0 && bench_now_ns() < deadline) {
+        if (bench_now_ns() >= next) {
+            produce_one(producer, 0, 0);
+            next = bench_now_ns() + E2E_WARMUP_INTERVAL_NS;
+        }
+        lws_service(context, E2E_SERVICE_MS);
+    }
+    return state.warmup_received > 0;
+}
+
+static void report(e2e_producer_t *producer, int clients, uint64_t elapsed_ns, pid_t core) {
+    uint64_t expected = (uint64_t)producer->messages * (uint64_t)clients;
+
+    printf("clients=%d messages=%zu rate=%.0f/s\n", clients, producer->messages, producer->rate);
+    printf("produced:   %.0f msgs/s\n", (double)producer->messages * 1e9 / (double)producer->elapsed_ns);
+    printf("delivered:  %llu/%llu (%.0f msgs/s)\n",
+           (unsigned long long)state.received, (unsigned long long)expected,
+           (double)state.received * 1e9 / (double)elapsed_ns);
+    printf("latency us: p50=%llu p99=%llu p999=%llu max=%llu\n",
+           (unsigned long long)bench_histogram_percentile(&state.latency, 50.0),
+           (unsigned long long)bench_histogram_percentile(&state.latency, 99.0),
+           (unsigned long long)bench_histogram_percentile(&state.latency, 99.9),
+           (unsigned long long)state.latency.max);
+    printf("core rss:   %ldkB (peak %ldkB)\n", bench_status_kb(core, "VmRSS"), bench_status_kb(core, "VmHWM"));
+}
+
+int main(int argc, char **argv) {
+    const char *core_path = argc > 1 ? argv[1] : LOOTOPIA_CORE_PATH;
+    int clients = (int)env_or("BENCH_CLIENTS", E2E_DEFAULT_CLIENTS);
+    int port = (int)env_or("BENCH_PORT", E2E_DEFAULT_PORT);
+    const char *bootstraps = NULL;
+    e2e_producer_t producer = {
+        .messages = (size_t)env_or("BENCH_MESSAGES", E2E_DEFAULT_MESSAGES),
+        .rate = (double)env_or("BENCH_RATE", E2E_DEFAULT_RATE)
+    };
+    struct lws_context_creation_info info;
+    pthread_t thread;
+    int status = EXIT_FAILURE;
+
+    producer.rk = create_mock_producer(&bootstraps);
+    if (!producer.rk) {
+        return EXIT_FAILURE;
+    }
+    producer.topic = rd_kafka_topic_new(producer.rk, E2E_TOPIC_IN, NULL);
+
+    pid_t core = spawn_core(core_path, bootstraps, port);
+    if (core < 0 || !wait_for_port(port)) {
+        fprintf(stderr, "e2e_bench: Core did not start listening on %d\n", port);
+        goto out;
+    }
+
+    lws_set_log_level(0, NULL);
+    memset(&info, 0, sizeof(info));
+    info.port = -1;
+    info.protocols = client_protocols;
+    info.gid = -1;
+    info.uid = -1;
+    struct lws_context *context = lws_create_context(&info);
+    if (!context) {
+        fprintf(stderr, "%s\n", "e2e_bench: failed to create client context");
+        goto out;
+    }
+
+    if (!connect_clients(context, port, clients)) {
+        fprintf(stderr, "e2e_bench: %d/%d clients connected\n", state.established, clients);
+    } else if (!warm_up(context, &producer)) {
+        fprintf(stderr, "%s\n", "e2e_bench: no message reached a client during warm-up");
+    } else {
+        uint64_t expected = (uint64_t)producer.messages * (uint64_t)clients;
+        uint64_t start = bench_now_ns();
+        uint64_t deadline = start + (uint64_t)((double)producer.messages / producer.rate * 1e9) +
+                            E2E_DRAIN_TIMEOUT_NS;
+
+        state.measuring = true;
+        pthread_create(&thread, NULL, produce_messages, &producer);
+        while (state.received < expected && bench_now_ns() < deadline) {
+            lws_service(context, E2E_SERVICE_MS);
+        }
+        uint64_t elapsed = bench_now_ns() - start;
+        pthread_join(thread, NULL);
+        report(&producer, clients, elapsed, core);
+        status = state.received == expected ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    lws_context_destroy(context);
+
+out:
+    if (core > 0) {
+        kill(core, SIGTERM);
+        waitpid(core, NULL, 0);
+    }
+    rd_kafka_topic_destroy(producer.topic);
+    rd_kafka_destroy(producer.rk);
+    return status;
+}
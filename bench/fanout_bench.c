@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "../inc/fanout.h"
+#include "../inc/websocket_server.h"
+
+#define FANOUT_BENCH_BROADCASTS 2000
+#define FANOUT_BENCH_CHANNELS 100
+#define FANOUT_BENCH_DRAIN_EVERY 32
+#define FANOUT_BENCH_CHANNEL_LEN 16
+
+static size_t drain_sessions(websocket_server_t *server, session_t *sessions, size_t count) {
+    size_t drained = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        while (session_queue_count(&sessions[i].queue) > 0) {
+            fanout_pop(server, &sessions[i]);
+            drained++;
+        }
+    }
+    return drained;
+}
+
+static void run(size_t session_count, bool keyed) {
+    websocket_server_t server;
+    ws_shard_t shard;
+    char channel[FANOUT_BENCH_CHANNEL_LEN];
+    session_t *sessions = calloc(session_count, sizeof(session_t));
+    payload_t *payloads[FANOUT_BENCH_CHANNELS];
+    uint64_t delivered = 0;
+    uint64_t elapsed = 0;
+
+    memset(&server, 0, sizeof(server));
+    memset(&shard, 0, sizeof(shard));
+    server.limits.policy = SLOW_CONSUMER_DROP_NEWEST;
+    server.limits.session_max_messages = WEBSOCKET_SERVER_RING_SIZE;
+    atomic_init(&server.queued_bytes, 0);
+    shard.server = &server;
+    if (!sessions || channel_index_init(&shard.channels) != 0) {
+        fprintf(stderr, "%s\n", "fanout_bench: setup failed");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t c = 0; c < FANOUT_BENCH_CHANNELS; c++) {
+        int len = snprintf(channel, sizeof(channel), "room-%zu", c);
+        payloads[c] = payload_create_routed("{\"bench\":true}", 14, channel, (size_t)len,
+                                            keyed ? channel : NULL, keyed ? (size_t)len : 0);
+    }
+    for (size_t i = 0; i < session_count; i++) {
+        fanout_attach(&shard, &sessions[i], (struct lws *)&sessions[i]);
+        if (keyed) {
+            int len = snprintf(channel, sizeof(channel), "room-%zu", i % FANOUT_BENCH_CHANNELS);
+            fanout_subscribe(&shard, &sessions[i], channel, (size_t)len);
+        } else {
+            fanout_subscribe(&shard, &sessions[i], CHANNEL_WILDCARD, strlen(CHANNEL_WILDCARD));
+        }
+    }
+
+    for (size_t b = 0; b < FANOUT_BENCH_BROADCASTS; b++) {
+        uint64_t start = bench_now_ns();
+        delivered += (uint64_t)fanout_broadcast(&shard, payloads[b % FANOUT_BENCH_CHANNELS]);
+        elapsed += bench_now_ns() - start;
+        if ((b + 1) % FANOUT_BENCH_DRAIN_EVERY == 0) {
+            drain_sessions(&server, sessions, session_count);
+        }
+    }
+
+    printf("%-7s sessions=%-6zu %10.0f broadcasts/s %12.0f deliveries/s %7.1f ns/delivery rss=%ldkB\n",
+           keyed ? "channel" : "all", session_count,
+           (double)FANOUT_BENCH_BROADCASTS * 1e9 / (double)elapsed,
+           (double)delivered * 1e9 / (double)elapsed,
+           delivered ? (double)elapsed / (double)delivered : 0.0,
+           bench_status_kb(0, "VmRSS"));
+
+    for (size_t i = 0; i < session_count; i++) {
+        fanout_detach(&shard, &sessions[i]);
+    }
+    for (size_t c = 0; c < FANOUT_BENCH_CHANNELS; c++) {
+        payload_release(payloads[c]);
+    }
+    channel_index_destroy(&shard.channels);
+    free(sessions);
+}
+
+int main(int argc, char **argv) {
+    size_t sizes[] = {1000, 10000, 50000};
+
+    if (argc > 1) {
+        sizes[0] = sizes[1] = sizes[2] = strtoull(argv[1], NULL, 10);
+    }
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        run(sizes[i], false);
+        run(sizes[i], true);
+        if (argc > 1) {
+            break;
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,19 @@
+#include <libwebsockets.h>
+
+int lws_callback_on_writable(struct lws *wsi) {
+    (void)wsi;
+    return 1;
+}
+
+void lws_close_reason(struct lws *wsi, enum lws_close_status status, unsigned char *buf, size_t len) {
+    (void)wsi;
+    (void)status;
+    (void)buf;
+    (void)len;
+}
+
+void lws_set_timeout(struct lws *wsi, enum pending_timeout reason, int secs) {
+    (void)wsi;
+    (void)reason;
+    (void)secs;
+}
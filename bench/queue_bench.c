@@ -0,0 +1,96 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "../inc/message_queue.h"
+
+#define QUEUE_BENCH_CAPACITY 4096
+#define QUEUE_BENCH_MESSAGES 5000000
+
+typedef struct {
+    message_queue_t *queue;
+    payload_t *payload;
+    size_t count;
+} producer_arg_t;
+
+static const char *mode_name(message_queue_mode_t mode) {
+    switch (mode) {
+        case MESSAGE_QUEUE_SPSC:
+            return "spsc";
+        case MESSAGE_QUEUE_MPSC:
+            return "mpsc";
+        default:
+            return "locked";
+    }
+}
+
+static void *produce(void *arg) {
+    producer_arg_t *producer = (producer_arg_t *)arg;
+
+    for (size_t i = 0; i < producer->count; i++) {
+        message_queue_push_payload(producer->queue, producer->payload);
+    }
+    return NULL;
+}
+
+static void run(message_queue_mode_t mode, int producers, size_t messages) {
+    pthread_t threads[producers];
+    producer_arg_t args[producers];
+    payload_t *payload = payload_create("x", 1);
+    message_queue_t *queue = message_queue_create(QUEUE_BENCH_CAPACITY, mode);
+    size_t per_producer = messages / (size_t)producers;
+    size_t expected = per_producer * (size_t)producers;
+    size_t received = 0;
+    size_t empty_polls = 0;
+    payload_t *popped;
+
+    if (!queue || !payload) {
+        fprintf(stderr, "queue_bench: setup failed for %s\n", mode_name(mode));
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < producers; i++) {
+        args[i] = (producer_arg_t){queue, payload, per_producer};
+        pthread_create(&threads[i], NULL, produce, &args[i]);
+    }
+    while (received < expected) {
+        if (message_queue_try_pop(queue, &popped)) {
+            received++;
+        } else {
+            empty_polls++;
+            sched_yield();
+        }
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    for (int i = 0; i < producers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    printf("%-7s producers=%-3d msgs=%-9zu %12.0f msgs/s %8.1f ns/msg empty_polls=%zu\n",
+           mode_name(mode), producers, received,
+           (double)received * 1e9 / (double)elapsed,
+           (double)elapsed / (double)received, empty_polls);
+
+    message_queue_destroy(queue);
+    payload_release(payload);
+}
+
+int main(int argc, char **argv) {
+    size_t messages = argc > 1 ? strtoull(argv[1], NULL, 10) : QUEUE_BENCH_MESSAGES;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int many = argc > 2 ? atoi(argv[2]) : (cpus > 4 ? (int)cpus - 1 : 4);
+    int counts[] = {1, 2, many};
+
+    run(MESSAGE_QUEUE_SPSC, 1, messages);
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        run(MESSAGE_QUEUE_MPSC, counts[i], messages);
+    }
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        run(MESSAGE_QUEUE_LOCKED, counts[i], messages);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,49 @@
+
+#ifndef LOOTOPIA_CHANNEL_INDEX_H
+#define LOOTOPIA_CHANNEL_INDEX_H
+
+#include "C/arguments.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define CHANNEL_INDEX_INITIAL_BUCKETS 64
+#define CHANNEL_INDEX_LOAD_FACTOR 2
+#define CHANNEL_WILDCARD "*"
+#define CHANNEL_NAME_MAX 128
+
+struct Channel;
+
+typedef struct Subscription {
+    struct Subscription *prev;
+    struct Subscription *next;
+    struct Channel *channel;
+    void *owner;
+} subscription_t;
+
+typedef struct Channel {
+    struct Channel *next;
+    uint32_t hash;
+    size_t subscriber_count;
+    subscription_t *subscribers;
+    size_t name_len;
+    char name[];
+} channel_t;
+
+typedef struct {
+    channel_t **buckets;
+    size_t bucket_count;
+    size_t channel_count;
+} channel_index_t;
+
+uint32_t channel_hash(IN const char *name, IN size_t len);
+int channel_index_init(IN channel_index_t *index);
+void channel_index_destroy(IN channel_index_t *index);
+channel_t *channel_index_find(IN channel_index_t *index, IN const char *name, IN size_t len);
+int channel_index_subscribe(IN channel_index_t *index,
+                            IN const char *name,
+                            IN size_t len,
+                            IN subscription_t *sub,
+                            IN void *owner);
+void channel_index_unsubscribe(IN channel_index_t *index, IN subscription_t *sub);
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef LOOTOPIA_DEFLATE_FRAME_H
+#define LOOTOPIA_DEFLATE_FRAME_H
+
+#include "C/arguments.h"
+#include "payload.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <zlib.h>
+
+#define DEFLATE_FRAME_WINDOW_BITS 15
+#define DEFLATE_FRAME_MEM_LEVEL 8
+#define DEFLATE_FRAME_TAIL_LEN 4
+#define DEFLATE_FRAME_HEADER_MAX 10
+#define DEFLATE_FRAME_FIN 0x80
+#define DEFLATE_FRAME_RSV1 0x40
+#define DEFLATE_FRAME_OPCODE_TEXT 0x1
+#define DEFLATE_FRAME_LEN_16 126
+#define DEFLATE_FRAME_LEN_64 127
+
+typedef struct {
+    z_stream stream;
+    size_t min_bytes;
+    bool ready;
+} deflate_frame_t;
+
+int deflate_frame_init(OUT deflate_frame_t *deflater, IN int level, IN size_t min_bytes);
+void deflate_frame_destroy(IN deflate_frame_t *deflater);
+payload_frame_t *deflate_frame_get(IN deflate_frame_t *deflater, IN payload_t *payload);
+
+#endif
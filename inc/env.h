@@ -14,6 +14,38 @@ typedef struct Config {
     char *websocket_service_secret;
     int message_queue_capacity;
     int kafka_poll_timeout_ms;
+    int kafka_consumer_batch_size;
+    int kafka_consumer_batch_wait_ms;
+    char *kafka_producer_profile;
+    int kafka_producer_linger_ms;
+    int kafka_producer_batch_bytes;
+    char *kafka_producer_compression;
+    int kafka_producer_burst;
+    int websocket_service_threads;
+    char *kafka_channel_header;
+    char *websocket_slow_consumer_policy;
+    int websocket_session_max_messages;
+    int websocket_session_max_bytes;
+    int websocket_global_max_bytes;
+    int websocket_slow_consumer_grace_ms;
+    int websocket_write_budget;
+    char *websocket_write_batch;
+    int kafka_pause_watermark;
+    int kafka_resume_watermark;
+    int websocket_ingress_pause_watermark;
+    int websocket_ingress_resume_watermark;
+    char *kafka_spill_dir;
+    int kafka_spill_segment_mb;
+    int kafka_spill_max_mb;
+    int websocket_replay_messages;
+    char *kafka_consumer_topics;
+    int kafka_consumer_workers;
+    int websocket_max_message_bytes;
+    int websocket_deflate_level;
+    int websocket_deflate_min_bytes;
+    char *kafka_commit_mode;
+    int kafka_commit_interval_ms;
+    int kafka_commit_batch;
 } config_t;
 
 
@@ -26,6 +58,38 @@ static const ConfigEntry entries[] = {
     {"INTERFACE", offsetof(config_t, interface), STR_T},
     {"WEBSOCKET_SERVICE_SECRET", offsetof(config_t, websocket_service_secret), STR_T},
     {"MSG_QUEUE_CAP", offsetof(config_t, message_queue_capacity), INT_T},
-    {"KAFKA_POLL", offsetof(config_t, kafka_poll_timeout_ms), INT_T}
+    {"KAFKA_POLL", offsetof(config_t, kafka_poll_timeout_ms), INT_T},
+    {"KAFKA_CONSUMER_BATCH", offsetof(config_t, kafka_consumer_batch_size), INT_T},
+    {"KAFKA_CONSUMER_BATCH_WAIT", offsetof(config_t, kafka_consumer_batch_wait_ms), INT_T},
+    {"KAFKA_PRODUCER_PROFILE", offsetof(config_t, kafka_producer_profile), STR_T},
+    {"KAFKA_PRODUCER_LINGER", offsetof(config_t, kafka_producer_linger_ms), INT_T},
+    {"KAFKA_PRODUCER_BATCH_BYTES", offsetof(config_t, kafka_producer_batch_bytes), INT_T},
+    {"KAFKA_PRODUCER_COMPRESSION", offsetof(config_t, kafka_producer_compression), STR_T},
+    {"KAFKA_PRODUCER_BURST", offsetof(config_t, kafka_producer_burst), INT_T},
+    {"WS_SERVICE_THREADS", offsetof(config_t, websocket_service_threads), INT_T},
+    {"KAFKA_CHANNEL_HEADER", offsetof(config_t, kafka_channel_header), STR_T},
+    {"WS_SLOW_CONSUMER_POLICY", offsetof(config_t, websocket_slow_consumer_policy), STR_T},
+    {"WS_SESSION_MAX_MESSAGES", offsetof(config_t, websocket_session_max_messages), INT_T},
+    {"WS_SESSION_MAX_BYTES", offsetof(config_t, websocket_session_max_bytes), INT_T},
+    {"WS_GLOBAL_MAX_BYTES", offsetof(config_t, websocket_global_max_bytes), INT_T},
+    {"WS_SLOW_CONSUMER_GRACE_MS", offsetof(config_t, websocket_slow_consumer_grace_ms), INT_T},
+    {"WS_WRITE_BUDGET", offsetof(config_t, websocket_write_budget), INT_T},
+    {"WS_WRITE_BATCH", offsetof(config_t, websocket_write_batch), STR_T},
+    {"KAFKA_PAUSE_WATERMARK", offsetof(config_t, kafka_pause_watermark), INT_T},
+    {"KAFKA_RESUME_WATERMARK", offsetof(config_t, kafka_resume_watermark), INT_T},
+    {"WS_INGRESS_PAUSE_WATERMARK", offsetof(config_t, websocket_ingress_pause_watermark), INT_T},
+    {"WS_INGRESS_RESUME_WATERMARK", offsetof(config_t, websocket_ingress_resume_watermark), INT_T},
+    {"KAFKA_SPILL_DIR", offsetof(config_t, kafka_spill_dir), STR_T},
+    {"KAFKA_SPILL_SEGMENT_MB", offsetof(config_t, kafka_spill_segment_mb), INT_T},
+    {"KAFKA_SPILL_MAX_MB", offsetof(config_t, kafka_spill_max_mb), INT_T},
+    {"WS_REPLAY_MESSAGES", offsetof(config_t, websocket_replay_messages), INT_T},
+    {"KAFKA_CONSUMER_TOPICS", offsetof(config_t, kafka_consumer_topics), STR_T},
+    {"KAFKA_CONSUMER_WORKERS", offsetof(config_t, kafka_consumer_workers), INT_T},
+    {"WS_MAX_MESSAGE_BYTES", offsetof(config_t, websocket_max_message_bytes), INT_T},
+    {"WS_DEFLATE_LEVEL", offsetof(config_t, websocket_deflate_level), INT_T},
+    {"WS_DEFLATE_MIN_BYTES", offsetof(config_t, websocket_deflate_min_bytes), INT_T},
+    {"KAFKA_COMMIT_MODE", offsetof(config_t, kafka_commit_mode), STR_T},
+    {"KAFKA_COMMIT_INTERVAL_MS", offsetof(config_t, kafka_commit_interval_ms), INT_T},
+    {"KAFKA_COMMIT_BATCH", offsetof(config_t, kafka_commit_batch), INT_T}
 };
 
@@ -0,0 +1,18 @@
+
+#ifndef LOOTOPIA_FANOUT_H
+#define LOOTOPIA_FANOUT_H
+
+#include "websocket_server.h"
+#include "payload.h"
+#include "C/arguments.h"
+#include <stddef.h>
+
+int fanout_attach(IN ws_shard_t *shard, IN session_t *pss, IN struct lws *wsi);
+void fanout_detach(IN ws_shard_t *shard, IN session_t *pss);
+void fanout_subscribe(IN ws_shard_t *shard, IN session_t *pss, IN const char *name, IN size_t len);
+int fanout_broadcast(IN ws_shard_t *shard, IN payload_t *payload);
+size_t fanout_pop(IN websocket_server_t *server, IN session_t *pss);
+void fanout_resume(IN ws_shard_t *shard, IN session_t *pss, IN uint64_t last_seq, IN uint64_t epoch);
+void fanout_replay(IN ws_shard_t *shard, IN session_t *pss);
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef LOOTOPIA_FILTER_H
+#define LOOTOPIA_FILTER_H
+
+#include "C/arguments.h"
+#include "payload.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define FILTER_ARG "filter="
+#define FILTER_ARG_MAX 512
+#define FILTER_MAX_CLAUSES 8
+#define FILTER_MAX_FIELDS 64
+#define FILTER_PATH_MAX 64
+#define FILTER_VALUE_MAX 64
+#define FILTER_CLAUSE_SEPARATOR ','
+#define FILTER_PATH_SEPARATOR '.'
+#define FILTER_KEY_FIELD "@key"
+#define FILTER_CHANNEL_FIELD "@channel"
+#define FILTER_NO_FIELD UINT16_MAX
+
+typedef enum {
+    FILTER_EQ,
+    FILTER_NE,
+    FILTER_LT,
+    FILTER_LE,
+    FILTER_GT,
+    FILTER_GE
+} filter_op_t;
+
+typedef enum {
+    FILTER_SOURCE_JSON,
+    FILTER_SOURCE_KEY,
+    FILTER_SOURCE_CHANNEL
+} filter_source_t;
+
+typedef struct {
+    const char *start;
+    size_t len;
+    double number;
+    bool found;
+    bool numeric;
+} filter_value_t;
+
+typedef struct {
+    filter_op_t op;
+    filter_source_t source;
+    uint16_t field;
+    filter_value_t value;
+    char text[FILTER_VALUE_MAX];
+} filter_clause_t;
+
+typedef struct {
+    int clause_count;
+    filter_clause_t clauses[];
+} filter_t;
+
+typedef struct {
+    char path[FILTER_PATH_MAX];
+    size_t path_len;
+    uint32_t refs;
+} filter_field_t;
+
+typedef struct {
+    filter_value_t value;
+    const payload_t *payload;
+    uint64_t seq;
+} filter_cache_t;
+
+typedef struct {
+    filter_field_t fields[FILTER_MAX_FIELDS];
+    filter_cache_t cache[FILTER_MAX_FIELDS];
+    size_t field_count;
+} filter_fields_t;
+
+filter_t *filter_compile(IN filter_fields_t *fields, IN const char *expr, IN size_t len);
+void filter_destroy(IN filter_fields_t *fields, IN filter_t *filter);
+bool filter_match(IN filter_fields_t *fields, IN const filter_t *filter, IN const payload_t *payload);
+
+#endif
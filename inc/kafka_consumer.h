@@ -3,14 +3,31 @@
 
 #include "env.h"
 #include "message_queue.h"
+#include "offset_tracker.h"
 #include "C/arguments.h"
 #include <librdkafka/rdkafka.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
 
 #define ERROR_STR_LEN 512
-#define KAFKA_PARTITION_LIST 1
 #define KAFKA_PARTITION_ASSIGNMENT -1
+#define KAFKA_LAG_SAMPLE_INTERVAL 64
+#define KAFKA_PAUSED_POLL_MS 10
+#define KAFKA_PERCENT 100
+#define KAFKA_TOPIC_SEPARATOR ','
+#define KAFKA_ROUTE_SEPARATOR '='
+#define KAFKA_WORKER_DEFAULT_BATCH 64
+#define KAFKA_REBALANCE_COOPERATIVE "COOPERATIVE"
+#define KAFKA_COMMIT_BROADCAST "broadcast"
+#define KAFKA_COMMIT_AUTO "auto"
+#define KAFKA_COMMIT_INTERVAL_MS 1000
+#define KAFKA_COMMIT_BATCH 10000
+#define KAFKA_OFFSET_FLUSH_MS 100
+#define KAFKA_OFFSET_FLUSH_MESSAGES 1000
+#define KAFKA_OFFSET_LIST_SIZE 16
+#define KAFKA_CONF_VALUE_LEN 32
 
 
 typedef struct {
@@ -19,9 +36,41 @@ typedef struct {
 } kafka_consumer_t;
 
 typedef struct {
+    bool enabled;
+    bool paused;
+    size_t high;
+    size_t low;
+} flow_control_t;
+
+typedef struct {
+    char *topic;
+    char *channel;
+    size_t channel_len;
+    int metrics_topic;
+} kafka_route_t;
+
+struct KafkaThreadArgs;
+
+typedef struct {
+    struct KafkaThreadArgs *args;
+    rd_kafka_queue_t *queue;
+    pthread_t thread;
+    bool started;
+} kafka_worker_t;
+
+typedef struct KafkaThreadArgs {
     const config_t *cfg;
     message_queue_t *queue;
     volatile sig_atomic_t *running;
+    rd_kafka_t *rk;
+    kafka_route_t *routes;
+    size_t route_count;
+    kafka_worker_t *workers;
+    int worker_count;
+    int next_worker;
+    offset_tracker_t *offsets;
+    uint64_t commit_batch;
+    flow_control_t flow;
 } kafka_thread_args_t;
 
 
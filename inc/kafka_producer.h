@@ -4,27 +4,61 @@
 #include "C/arguments.h"
 #include "env.h"
 #include "message_queue.h"
+#include "payload.h"
+#include "spill_log.h"
 #include <pthread.h>
 #include <signal.h>
 #include <librdkafka/rdkafka.h>
 
 #define KAFKA_PRODUCER_FLUSH 5000
+#define KAFKA_PRODUCER_WAIT_FDS 2
+#define KAFKA_PRODUCER_DEFAULT_BURST 256
+#define KAFKA_PRODUCER_PROFILE_THROUGHPUT "throughput"
+#define KAFKA_PRODUCER_LATENCY_LINGER_MS 0
+#define KAFKA_PRODUCER_LATENCY_COMPRESSION "none"
+#define KAFKA_PRODUCER_THROUGHPUT_LINGER_MS 20
+#define KAFKA_PRODUCER_THROUGHPUT_BATCH_BYTES 1048576
+#define KAFKA_PRODUCER_THROUGHPUT_COMPRESSION "lz4"
+#define KAFKA_CONF_VALUE_LEN 32
 #define ERROR_STR_LEN 512
+#define KAFKA_SPILL_MAX_IN_FLIGHT 10000
+#define KAFKA_SPILL_RETRY_MIN_MS 100
+#define KAFKA_SPILL_RETRY_MAX_MS 10000
 
 typedef struct {
     pthread_t thread;
     volatile sig_atomic_t *running;
 } kafka_producer_t;
 
+typedef struct {
+    int linger_ms;
+    int batch_bytes;
+    const char *compression;
+} producer_profile_t;
+
+typedef struct {
+    payload_t **payloads;
+    rd_kafka_message_t *rkmessages;
+    size_t capacity;
+} producer_burst_t;
+
+typedef struct {
+    spill_log_t *log;
+    uint64_t resume_us;
+    uint64_t backoff_ms;
+} spill_replay_t;
+
 typedef struct {
     const config_t *cfg;
     message_queue_t *queue;
+    spill_replay_t replay;
     volatile sig_atomic_t *running;
 } producer_thread_args_t;
 
 int kafka_producer_start(IN kafka_producer_t *producer,
                          IN const config_t *cfg,
                          IN message_queue_t *queue,
+                         IN spill_log_t *spill,
                          IN volatile sig_atomic_t *running_flag);
 
 void kafka_producer_stop(IN kafka_producer_t *producer);
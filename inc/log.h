@@ -1,28 +1,60 @@
 #ifndef LOOTOPIA_LOG_H
 #define LOOTOPIA_LOG_H
 
-#include <stdio.h>
-#include <time.h>
-
-static inline void log_timestamp(char *buf, size_t buflen) {
-    struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
-    struct tm tm_info;
-    localtime_r(&ts.tv_sec, &tm_info);
-    strftime(buf, buflen, "%Y-%m-%d %H:%M:%S", &tm_info);
-}
-
-#define LOG_STREAM(level, fmt, ...)                          \
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LOG_LINE_MAX 512
+#define LOG_RING_SLOTS 256
+#define LOG_RATE_LIMIT 20
+#define LOG_TIMESTAMP_LEN 32
+#define LOG_CACHE_LINE 64
+
+typedef enum {
+    LOG_STDOUT = 1,
+    LOG_STDERR = 2
+} log_stream_t;
+
+typedef struct LogSite {
+    atomic_llong window;
+    atomic_uint count;
+    atomic_uint suppressed;
+    atomic_bool listed;
+    log_stream_t stream;
+    const char *fmt;
+    struct LogSite *next;
+} log_site_t;
+
+typedef struct {
+    log_stream_t stream;
+    uint16_t len;
+    char text[LOG_LINE_MAX];
+} log_record_t;
+
+typedef struct LogRing {
+    struct LogRing *next;
+    atomic_bool retired;
+    alignas(LOG_CACHE_LINE) atomic_size_t head;
+    alignas(LOG_CACHE_LINE) atomic_size_t tail;
+    log_record_t records[LOG_RING_SLOTS];
+} log_ring_t;
+
+int log_init(void);
+void log_shutdown(void);
+void log_write(log_site_t *site, log_stream_t stream, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+#define LOG_STREAM(stream, fmt, ...)                         \
     do {                                                     \
-        char _ts[32];                                        \
-        log_timestamp(_ts, sizeof(_ts));                     \
-        fprintf(level, "[%s] " fmt "\n", _ts, ##__VA_ARGS__);\
-        fflush(level);                                       \
+        static log_site_t _site;                             \
+        log_write(&_site, stream, fmt, ##__VA_ARGS__);       \
     } while (0)
 
-#define LOG_INFO(fmt, ...)  LOG_STREAM(stdout, "INFO: " fmt, ##__VA_ARGS__)
-#define LOG_WARN(fmt, ...)  LOG_STREAM(stdout, "WARN: " fmt, ##__VA_ARGS__)
-#define LOG_ERROR(fmt, ...) LOG_STREAM(stderr, "ERROR: " fmt, ##__VA_ARGS__)
+#define LOG_INFO(fmt, ...)  LOG_STREAM(LOG_STDOUT, "INFO: " fmt, ##__VA_ARGS__)
+#define LOG_WARN(fmt, ...)  LOG_STREAM(LOG_STDOUT, "WARN: " fmt, ##__VA_ARGS__)
+#define LOG_ERROR(fmt, ...) LOG_STREAM(LOG_STDERR, "ERROR: " fmt, ##__VA_ARGS__)
 
 #endif
-
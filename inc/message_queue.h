@@ -1,33 +1,67 @@
+
 #ifndef LOOTOPIA_MESSAGE_QUEUE_H
 #define LOOTOPIA_MESSAGE_QUEUE_H
 
 #include "C/arguments.h"
+#include "payload.h"
+#include <stdalign.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <pthread.h>
 
-typedef struct message_node {
-    char *data;
-    size_t len;
-    struct message_node *next;
-} message_node_t;
+#define MESSAGE_QUEUE_CACHE_LINE 64
+#define MESSAGE_QUEUE_SPIN_LIMIT 64
+#define MESSAGE_QUEUE_BACKOFF_NS 50000
+
+typedef enum {
+    MESSAGE_QUEUE_LOCKED,
+    MESSAGE_QUEUE_SPSC,
+    MESSAGE_QUEUE_MPSC
+} message_queue_mode_t;
+
+typedef void (*message_queue_notify_fn)(void *ctx);
+
+typedef struct {
+    atomic_size_t seq;
+    payload_t *payload;
+} message_slot_t;
 
 typedef struct {
-    message_node_t *head;
-    message_node_t *tail;
-    size_t size;
+    message_queue_mode_t mode;
     size_t capacity;
-    bool closed;
+    size_t mask;
+    message_slot_t *slots;
+    atomic_bool closed;
     pthread_mutex_t mutex;
     pthread_cond_t cond_nonempty;
     pthread_cond_t cond_nonfull;
+    int event_fd;
+    message_queue_notify_fn notify;
+    void *notify_ctx;
+    atomic_bool wakeup_pending;
+
+    alignas(MESSAGE_QUEUE_CACHE_LINE) atomic_size_t head;
+    size_t tail_cache;
+
+    alignas(MESSAGE_QUEUE_CACHE_LINE) atomic_size_t tail;
+    size_t head_cache;
 } message_queue_t;
 
-message_queue_t *message_queue_create(IN size_t capacity);
+message_queue_t *message_queue_create(IN size_t capacity, IN message_queue_mode_t mode);
 void message_queue_destroy(IN message_queue_t *queue);
 bool message_queue_push(IN message_queue_t *queue, IN const char *data, IN size_t len);
-bool message_queue_try_pop(IN message_queue_t *queue, OUT char **data, OUT size_t *len);
+bool message_queue_push_payload(IN message_queue_t *queue, IN payload_t *payload);
+bool message_queue_try_push_payload(IN message_queue_t *queue, IN payload_t *payload);
+size_t message_queue_push_batch(IN message_queue_t *queue, IN payload_t **payloads, IN size_t count);
+bool message_queue_try_pop(IN message_queue_t *queue, OUT payload_t **payload);
+size_t message_queue_try_pop_batch(IN message_queue_t *queue, OUT payload_t **payloads, IN size_t max);
 void message_queue_close(IN message_queue_t *queue);
+size_t message_queue_size(IN message_queue_t *queue);
+int message_queue_event_fd(IN message_queue_t *queue);
+void message_queue_set_notify(IN message_queue_t *queue,
+                              IN message_queue_notify_fn notify,
+                              IN void *ctx);
+void message_queue_clear_wakeup(IN message_queue_t *queue);
 
 #endif
-
@@ -0,0 +1,123 @@
+
+#ifndef LOOTOPIA_METRICS_H
+#define LOOTOPIA_METRICS_H
+
+#include "C/arguments.h"
+#include "message_queue.h"
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define METRICS_PATH "/metrics"
+#define METRICS_CONTENT_TYPE "text/plain; version=0.0.4"
+#define METRICS_BUFFER_SIZE (64 * 1024)
+#define METRICS_MAX_THREADS 64
+#define METRICS_MAX_QUEUES 64
+#define METRICS_MAX_PARTITIONS 256
+#define METRICS_QUEUE_NAME_LEN 32
+#define METRICS_MAX_TOPICS 16
+#define METRICS_TOPIC_NAME_LEN 256
+#define METRICS_CACHE_LINE 64
+#define METRICS_HISTOGRAM_SUB_BITS 3
+#define METRICS_HISTOGRAM_SUB_BUCKETS (1 << METRICS_HISTOGRAM_SUB_BITS)
+#define METRICS_HISTOGRAM_MAX_EXP 39
+#define METRICS_HISTOGRAM_BUCKETS \
+    (((METRICS_HISTOGRAM_MAX_EXP - METRICS_HISTOGRAM_SUB_BITS + 1) << METRICS_HISTOGRAM_SUB_BITS) + METRICS_HISTOGRAM_SUB_BUCKETS)
+
+typedef enum {
+    METRIC_KAFKA_CONSUMED,
+    METRIC_KAFKA_CONSUMED_BYTES,
+    METRIC_CONSUMER_QUEUE_DROPS,
+    METRIC_PRODUCER_QUEUE_DROPS,
+    METRIC_SHARD_INBOX_DROPS,
+    METRIC_BROADCAST_QUEUE_DROPS,
+    METRIC_BROADCASTS,
+    METRIC_FANOUT_DELIVERIES,
+    METRIC_SESSION_DROPS,
+    METRIC_SESSION_DROPPED_BYTES,
+    METRIC_SESSION_CONFLATED,
+    METRIC_FRAMES_WRITTEN,
+    METRIC_BYTES_WRITTEN,
+    METRIC_PRODUCER_DELIVERED,
+    METRIC_PRODUCER_DELIVERY_FAILURES,
+    METRIC_PRODUCER_LATENCY_US,
+    METRIC_CONSUMER_PAUSES,
+    METRIC_SPILLED,
+    METRIC_SPILL_REPLAYED,
+    METRIC_SPILL_DROPS,
+    METRIC_REPLAYED,
+    METRIC_REPLAY_GAPS,
+    METRIC_REPLAY_RESETS,
+    METRIC_OVERSIZED_MESSAGES,
+    METRIC_PAYLOAD_POOL_HITS,
+    METRIC_PAYLOAD_POOL_MISSES,
+    METRIC_DEFLATE_FRAMES,
+    METRIC_DEFLATE_IN_BYTES,
+    METRIC_DEFLATE_OUT_BYTES,
+    METRIC_DEFLATE_FALLBACKS,
+    METRIC_FILTERED,
+    METRIC_OFFSETS_STORED,
+    METRIC_OFFSET_COMMITS,
+    METRIC_COUNTER_COUNT
+} metric_counter_t;
+
+typedef enum {
+    METRIC_SESSIONS,
+    METRIC_CONSUMER_PAUSED,
+    METRIC_SESSIONS_RX_PAUSED,
+    METRIC_GAUGE_COUNT
+} metric_gauge_t;
+
+typedef enum {
+    METRIC_LATENCY_CONSUMER_QUEUE,
+    METRIC_LATENCY_INBOX,
+    METRIC_LATENCY_SESSION_QUEUE,
+    METRIC_LATENCY_INGRESS_TO_SOCKET,
+    METRIC_LATENCY_KAFKA_TO_SOCKET,
+    METRIC_LATENCY_RECEIVE_TO_PRODUCE,
+    METRIC_LATENCY_PRODUCE_TO_ACK,
+    METRIC_HISTOGRAM_COUNT
+} metric_histogram_t;
+
+typedef struct {
+    alignas(METRICS_CACHE_LINE) atomic_uint_fast64_t counters[METRIC_COUNTER_COUNT];
+    atomic_uint_fast64_t histogram_sums[METRIC_HISTOGRAM_COUNT];
+    atomic_uint_fast64_t histograms[METRIC_HISTOGRAM_COUNT][METRICS_HISTOGRAM_BUCKETS];
+} metrics_slot_t;
+
+typedef struct {
+    char name[METRICS_QUEUE_NAME_LEN];
+    message_queue_t *queue;
+} metrics_queue_t;
+
+typedef struct {
+    char name[METRICS_TOPIC_NAME_LEN];
+    atomic_int partition_count;
+    atomic_int_fast64_t lag[METRICS_MAX_PARTITIONS];
+} metrics_topic_t;
+
+void metrics_add(IN metric_counter_t counter, IN uint64_t value);
+void metrics_record(IN metric_histogram_t histogram, IN uint64_t value_us);
+void metrics_record_since(IN metric_histogram_t histogram, IN uint64_t start_us, IN uint64_t now_us);
+void metrics_gauge_add(IN metric_gauge_t gauge, IN int64_t delta);
+int metrics_register_topic(IN const char *name);
+void metrics_set_partition_lag(IN int topic, IN int32_t partition, IN int64_t lag);
+void metrics_register_queue(IN const char *name, IN message_queue_t *queue);
+void metrics_unregister_queue(IN message_queue_t *queue);
+char *metrics_render(IN size_t headroom, OUT size_t *len);
+
+static inline uint64_t metrics_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+static inline uint64_t metrics_wall_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+}
+
+#endif
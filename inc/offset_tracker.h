@@ -0,0 +1,43 @@
+#ifndef LOOTOPIA_OFFSET_TRACKER_H
+#define LOOTOPIA_OFFSET_TRACKER_H
+
+#include "C/arguments.h"
+#include "payload.h"
+#include <librdkafka/rdkafka.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define OFFSET_TRACKER_PARTITIONS 1024
+#define OFFSET_TRACKER_NONE -1
+#define OFFSET_TRACKER_OFFSET_BITS 48
+#define OFFSET_TRACKER_OFFSET_MASK ((UINT64_C(1) << OFFSET_TRACKER_OFFSET_BITS) - 1)
+#define OFFSET_TRACKER_GENERATION_MASK ((UINT64_C(1) << (64 - OFFSET_TRACKER_OFFSET_BITS)) - 1)
+
+typedef struct OffsetSlot {
+    atomic_uint_fast64_t done;
+    atomic_uint_fast64_t generation;
+    int64_t stored;
+} offset_slot_t;
+
+typedef struct {
+    offset_slot_t *slots;
+    const char **topics;
+    size_t topic_count;
+    atomic_size_t high;
+    atomic_uint_fast64_t tracked;
+    uint64_t flushed;
+    uint64_t committed;
+    uint64_t flushed_ms;
+} offset_tracker_t;
+
+int offset_tracker_init(OUT offset_tracker_t *tracker, IN const char **topics, IN size_t topic_count);
+void offset_tracker_destroy(IN offset_tracker_t *tracker);
+bool offset_tracker_track(IN offset_tracker_t *tracker, IN payload_t *payload,
+                          IN size_t topic, IN int32_t partition, IN int64_t offset);
+void offset_tracker_reset(IN offset_tracker_t *tracker, IN size_t topic, IN int32_t partition);
+size_t offset_tracker_collect(IN offset_tracker_t *tracker, OUT rd_kafka_topic_partition_list_t *list);
+void offset_tracker_mark(IN payload_t *payload);
+
+#endif
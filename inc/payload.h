@@ -0,0 +1,60 @@
+
+#ifndef LOOTOPIA_PAYLOAD_H
+#define LOOTOPIA_PAYLOAD_H
+
+#include "C/arguments.h"
+#include <libwebsockets.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PAYLOAD_HEADROOM LWS_PRE
+#define PAYLOAD_HASH_SEED 2166136261u
+#define PAYLOAD_HASH_PRIME 16777619u
+
+typedef struct PayloadFrame {
+    size_t len;
+    unsigned char *start;
+    unsigned char buf[];
+} payload_frame_t;
+
+struct OffsetSlot;
+
+typedef struct Payload {
+    atomic_uint refs;
+    size_t len;
+    const char *key;
+    size_t key_len;
+    uint32_t key_hash;
+    const char *channel;
+    size_t channel_len;
+    int64_t source_ts_ms;
+    uint64_t ingress_us;
+    uint64_t dispatch_us;
+    uint64_t seq;
+    size_t capacity;
+    struct Payload *pool_next;
+    _Atomic(payload_frame_t *) frame;
+    struct OffsetSlot *commit_slot;
+    uint64_t commit_generation;
+    int64_t offset;
+    atomic_uint pending_marks;
+    struct Payload *origin;
+    uint8_t spilled;
+    uint8_t size_class;
+    unsigned char buf[];
+} payload_t;
+
+payload_t *payload_create(IN const char *data, IN size_t len);
+payload_t *payload_create_routed(IN const char *data, IN size_t len,
+                                 IN const char *key, IN size_t key_len,
+                                 IN const char *channel, IN size_t channel_len);
+payload_t *payload_clone(IN payload_t *payload);
+payload_t *payload_retain(IN payload_t *payload);
+void payload_release(IN payload_t *payload);
+
+static inline unsigned char *payload_data(IN payload_t *payload) {
+    return payload->buf + PAYLOAD_HEADROOM;
+}
+
+#endif
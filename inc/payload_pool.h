@@ -0,0 +1,48 @@
+#ifndef LOOTOPIA_PAYLOAD_POOL_H
+#define LOOTOPIA_PAYLOAD_POOL_H
+
+#include "C/arguments.h"
+#include "payload.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PAYLOAD_POOL_MIN_SHIFT 10
+#define PAYLOAD_POOL_CLASSES 11
+#define PAYLOAD_POOL_CLASS_CACHE_BYTES (4 * 1024 * 1024)
+#define PAYLOAD_POOL_THREAD_CACHE_BYTES (256 * 1024)
+#define PAYLOAD_POOL_THREAD_CACHE_MAX 64
+#define PAYLOAD_POOL_MIN_CACHED 2
+#define PAYLOAD_UNPOOLED 0xff
+
+typedef struct {
+    pthread_mutex_t mutex;
+    payload_t *free;
+    size_t count;
+    atomic_size_t allocated;
+    atomic_size_t released;
+} payload_class_t;
+
+typedef struct {
+    payload_t *free;
+    size_t count;
+} payload_cache_t;
+
+typedef struct {
+    payload_cache_t classes[PAYLOAD_POOL_CLASSES];
+} payload_thread_cache_t;
+
+typedef struct {
+    size_t bytes;
+    size_t allocated;
+    size_t released;
+    size_t cached;
+} payload_pool_stats_t;
+
+payload_t *payload_pool_acquire(IN size_t capacity);
+payload_t *payload_pool_grow(IN payload_t *payload, IN size_t capacity);
+void payload_pool_put(IN payload_t *payload);
+void payload_pool_stats(IN int size_class, OUT payload_pool_stats_t *stats);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef LOOTOPIA_REPLAY_RING_H
+#define LOOTOPIA_REPLAY_RING_H
+
+#include "C/arguments.h"
+#include "payload.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    payload_t **entries;
+    uint64_t mask;
+    uint64_t head;
+} replay_ring_t;
+
+int replay_ring_init(IN replay_ring_t *ring, IN size_t capacity);
+void replay_ring_destroy(IN replay_ring_t *ring);
+void replay_ring_push(IN replay_ring_t *ring, IN payload_t *payload);
+uint64_t replay_ring_find(IN const replay_ring_t *ring, IN uint64_t last_seq);
+
+static inline uint64_t replay_ring_oldest(IN const replay_ring_t *ring) {
+    return ring->head > ring->mask ? ring->head - ring->mask - 1 : 0;
+}
+
+static inline payload_t *replay_ring_at(IN const replay_ring_t *ring, IN uint64_t position) {
+    return ring->entries[position & ring->mask];
+}
+
+#endif
@@ -0,0 +1,46 @@
+
+#ifndef LOOTOPIA_SESSION_QUEUE_H
+#define LOOTOPIA_SESSION_QUEUE_H
+
+#include "C/arguments.h"
+#include "payload.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct MSG {
+    payload_t *payload;
+    uint64_t enqueued_us;
+} msg_t;
+
+typedef struct {
+    msg_t *entries;
+    uint32_t mask;
+    uint32_t head;
+    uint32_t tail;
+    size_t bytes;
+    uint64_t key_bits;
+} session_queue_t;
+
+int session_queue_init(IN session_queue_t *queue, IN uint32_t capacity);
+void session_queue_destroy(IN session_queue_t *queue);
+bool session_queue_push(IN session_queue_t *queue, IN payload_t *payload, IN uint64_t enqueued_us);
+msg_t *session_queue_peek(IN session_queue_t *queue);
+msg_t *session_queue_at(IN session_queue_t *queue, IN uint32_t index);
+size_t session_queue_pop(IN session_queue_t *queue);
+msg_t *session_queue_find_key(IN session_queue_t *queue, IN const payload_t *payload);
+size_t session_queue_remove(IN session_queue_t *queue, IN msg_t *msg);
+
+static inline uint64_t session_queue_key_bit(IN const payload_t *payload) {
+    return payload->key_len > 0 ? (uint64_t)1 << (payload->key_hash & 63u) : 0;
+}
+
+static inline uint32_t session_queue_count(IN const session_queue_t *queue) {
+    return queue->head - queue->tail;
+}
+
+static inline bool session_queue_full(IN const session_queue_t *queue) {
+    return session_queue_count(queue) > queue->mask;
+}
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef LOOTOPIA_SPILL_LOG_H
+#define LOOTOPIA_SPILL_LOG_H
+
+#include "C/arguments.h"
+#include "payload.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SPILL_LOG_MB (1024 * 1024)
+#define SPILL_LOG_DEFAULT_SEGMENT_MB 64
+#define SPILL_LOG_DEFAULT_MAX_MB 1024
+#define SPILL_LOG_MIN_SEGMENTS 2
+#define SPILL_LOG_ALIGN 8
+#define SPILL_LOG_PATH_MAX 4096
+#define SPILL_LOG_PREFIX "spill-"
+#define SPILL_LOG_SUFFIX ".log"
+#define SPILL_LOG_CURSOR "cursor"
+
+typedef struct {
+    uint32_t len;
+    uint32_t reserved;
+} spill_record_t;
+
+typedef struct {
+    uint64_t seq;
+    uint64_t off;
+} spill_cursor_t;
+
+typedef struct {
+    uint64_t seq;
+    int fd;
+    unsigned char *base;
+    size_t write_off;
+} spill_segment_t;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    char *dir;
+    size_t segment_size;
+    size_t max_segments;
+    spill_segment_t *segments;
+    size_t segment_count;
+    size_t segment_capacity;
+    size_t commit_off;
+    size_t read_index;
+    size_t read_off;
+    size_t window;
+    size_t in_flight;
+    bool failed;
+    int cursor_fd;
+    uint64_t next_seq;
+    atomic_size_t pending;
+} spill_log_t;
+
+spill_log_t *spill_log_open(IN const char *dir, IN size_t segment_size, IN size_t max_bytes);
+void spill_log_close(IN spill_log_t *log);
+bool spill_log_append(IN spill_log_t *log, IN const char *data, IN size_t len);
+size_t spill_log_read(IN spill_log_t *log, OUT payload_t **payloads, IN size_t max);
+bool spill_log_ack(IN spill_log_t *log, IN bool delivered);
+size_t spill_log_in_flight(IN spill_log_t *log);
+
+static inline size_t spill_log_pending(IN spill_log_t *log) {
+    return atomic_load_explicit(&log->pending, memory_order_acquire);
+}
+
+#endif
@@ -1,38 +1,170 @@
+
 #ifndef LOOTOPIA_WEBSOCKET_SERVER_H
 #define LOOTOPIA_WEBSOCKET_SERVER_H
 
 #include "env.h"
 #include "message_queue.h"
 #include "kafka_producer.h"
+#include "payload.h"
+#include "channel_index.h"
+#include "session_queue.h"
+#include "spill_log.h"
+#include "replay_ring.h"
+#include "deflate_frame.h"
+#include "filter.h"
 #include "C/arguments.h"
 #include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <pthread.h>
 #include <libwebsockets.h>
 
 #define WEBSOCKET_SERVER_RING_SIZE 64
-#define WEBSOCKET_SINGLE_TAIL 1
+#define WEBSOCKET_PROTOCOL_TEXT "lootopia-ws"
+#define WEBSOCKET_PROTOCOL_BINARY "lootopia-binary"
+#define WEBSOCKET_PROTOCOL_ENVELOPE "lootopia-envelope"
+#define WEBSOCKET_FORMAT_ARG "format="
+#define WEBSOCKET_FORMAT_BINARY "binary"
+#define WEBSOCKET_FORMAT_ENVELOPE "envelope"
+#define WEBSOCKET_FIELD_LEN 2
+#define WEBSOCKET_SERVICE_WAIT 0
+#define WEBSOCKET_DEFAULT_SHARDS 1
+#define WEBSOCKET_MAX_CHANNELS 8
+#define WEBSOCKET_PATH_MAX 512
+#define WEBSOCKET_CHANNEL_SEPARATOR ','
+#define WEBSOCKET_POLICY_DROP_NEWEST "drop-newest"
+#define WEBSOCKET_POLICY_DROP_OLDEST "drop-oldest"
+#define WEBSOCKET_POLICY_DISCONNECT "disconnect"
+#define WEBSOCKET_POLICY_CONFLATE "conflate"
+#define WEBSOCKET_WRITE_BUDGET (64 * 1024)
+#define WEBSOCKET_BATCH_JSON "json"
+#define WEBSOCKET_BATCH_BINARY "binary"
+#define WEBSOCKET_BATCH_PREFIX_LEN 4
+#define WEBSOCKET_HTTP_HEADER_SIZE 512
+#define WEBSOCKET_INGRESS_PAUSE_PERCENT 80
+#define WEBSOCKET_INGRESS_RESUME_PERCENT 50
+#define WEBSOCKET_RX_RESUME_CHECK_MS 10
+#define WEBSOCKET_PERCENT 100
+#define WEBSOCKET_REPLAY_MESSAGES 1024
+#define WEBSOCKET_LAST_SEQ_ARG "last_seq="
+#define WEBSOCKET_SEQ_ARG "seq="
+#define WEBSOCKET_EPOCH_ARG "epoch="
+#define WEBSOCKET_ARG_MAX 32
+#define WEBSOCKET_SEQ_LEN 8
+#define WEBSOCKET_EPOCH_LEN 8
+#define WEBSOCKET_ENVELOPE_PREFIX "{\"epoch\":%llu,\"seq\":%llu,\"data\":"
+#define WEBSOCKET_ENVELOPE_MAX 72
+#define WEBSOCKET_MAX_MESSAGE_BYTES (1024 * 1024)
+#define WEBSOCKET_DEFLATE_EXTENSION "permessage-deflate"
+#define WEBSOCKET_DEFLATE_OFFER "permessage-deflate; client_no_context_takeover; client_max_window_bits"
+#define WEBSOCKET_DEFLATE_LEVEL_OPTION "compression_level"
+#define WEBSOCKET_DEFLATE_WINDOW_PARAM "server_max_window_bits="
+#define WEBSOCKET_DEFLATE_MAX_LEVEL 9
+#define WEBSOCKET_DEFLATE_MIN_BYTES 64
+
+typedef enum {
+    SLOW_CONSUMER_DROP_NEWEST,
+    SLOW_CONSUMER_DROP_OLDEST,
+    SLOW_CONSUMER_DISCONNECT,
+    SLOW_CONSUMER_CONFLATE
+} slow_consumer_policy_t;
+
+typedef enum {
+    WRITE_BATCH_NONE,
+    WRITE_BATCH_JSON,
+    WRITE_BATCH_BINARY
+} write_batch_mode_t;
+
+typedef struct {
+    write_batch_mode_t batch;
+    size_t budget;
+} write_options_t;
+
+typedef struct {
+    slow_consumer_policy_t policy;
+    uint32_t session_max_messages;
+    size_t session_max_bytes;
+    size_t global_max_bytes;
+    uint64_t grace_ms;
+} backlog_limits_t;
+
+typedef struct {
+    bool enabled;
+    int level;
+    size_t min_bytes;
+} deflate_options_t;
+
+typedef struct {
+    size_t pause_at;
+    size_t resume_at;
+} ingress_limits_t;
 
-typedef struct MSG {
-    void *payload;
-    size_t len;
-} msg_t;
+typedef struct {
+    uint64_t dropped_messages;
+    uint64_t dropped_bytes;
+    uint64_t conflated_messages;
+    uint64_t sent_messages;
+    uint64_t sent_bytes;
+} session_stats_t;
 
 typedef struct Session {
     struct Session *prev;
     struct Session *next;
     struct lws *wsi;
-    struct lws_ring *ring;
-    uint32_t tail;
+    session_queue_t queue;
+    payload_t *rx;
+    filter_t *filter;
+    session_stats_t stats;
+    uint64_t over_budget_since_ms;
+    bool closing;
+    bool rx_paused;
+    bool sequenced;
+    bool replaying;
+    bool shared_deflate;
+    bool binary;
+    bool enveloped;
+    uint64_t replay_position;
+    subscription_t subscriptions[WEBSOCKET_MAX_CHANNELS];
+    int subscription_count;
 } session_t;
 
-typedef struct websocket_server {
+struct websocket_server;
+
+typedef struct Shard {
+    struct websocket_server *server;
     struct lws_context *context;
+    message_queue_t *inbox;
+    session_t *clients;
+    channel_index_t channels;
+    replay_ring_t replay;
+    deflate_frame_t deflate;
+    filter_fields_t filters;
+    unsigned char *write_buffer;
+    size_t write_buffer_size;
+    lws_sorted_usec_list_t rx_resume;
+    size_t rx_paused;
+    pthread_t thread;
+    bool started;
+    int index;
+} ws_shard_t;
+
+typedef struct websocket_server {
     const struct lws_protocols *protocol;
     message_queue_t *consumer_queue;
     message_queue_t *producer_queue;
+    message_queue_t *broadcast_queue;
+    spill_log_t *spill;
     volatile sig_atomic_t *running;
-    pthread_mutex_t clients_lock;
-    session_t *clients;
+    ws_shard_t *shards;
+    int shard_count;
+    backlog_limits_t limits;
+    write_options_t write;
+    ingress_limits_t ingress;
+    deflate_options_t deflate;
+    size_t max_message_bytes;
+    atomic_size_t queued_bytes;
+    atomic_uint_fast64_t next_seq;
+    uint64_t epoch;
     int port;
     char *websocket_service_secret;
 } websocket_server_t;
@@ -40,6 +172,7 @@ typedef struct websocket_server {
 websocket_server_t *websocket_server_create(IN const config_t *cfg,
                                             IN message_queue_t *consumer_queue,
                                             IN message_queue_t *producer_queue,
+                                            IN spill_log_t *spill,
                                             IN volatile sig_atomic_t *running_flag);
 
 int websocket_server_run(IN websocket_server_t *server);
@@ -0,0 +1,156 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../inc/channel_index.h"
+
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+uint32_t channel_hash(IN const char *name, IN size_t len) {
+    uint32_t hash = FNV_OFFSET_BASIS;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+int channel_index_init(IN channel_index_t *index) {
+    index->buckets = calloc(CHANNEL_INDEX_INITIAL_BUCKETS, sizeof(channel_t *));
+    if (!index->buckets) {
+        return -1;
+    }
+    index->bucket_count = CHANNEL_INDEX_INITIAL_BUCKETS;
+    index->channel_count = 0;
+    return 0;
+}
+
+void channel_index_destroy(IN channel_index_t *index) {
+    if (!index->buckets) {
+        return;
+    }
+    for (size_t i = 0; i < index->bucket_count; i++) {
+        channel_t *channel = index->buckets[i];
+        while (channel) {
+            channel_t *next = channel->next;
+            free(channel);
+            channel = next;
+        }
+    }
+    free(index->buckets);
+    index->buckets = NULL;
+    index->bucket_count = 0;
+    index->channel_count = 0;
+}
+
+static channel_t *find_hashed(IN channel_index_t *index,
+                              IN const char *name,
+                              IN size_t len,
+                              IN uint32_t hash) {
+    channel_t *channel = index->buckets[hash & (index->bucket_count - 1)];
+    while (channel) {
+        if (channel->hash == hash && channel->name_len == len &&
+            memcmp(channel->name, name, len) == 0) {
+            return channel;
+        }
+        channel = channel->next;
+    }
+    return NULL;
+}
+
+channel_t *channel_index_find(IN channel_index_t *index, IN const char *name, IN size_t len) {
+    if (!index->buckets || !name) {
+        return NULL;
+    }
+    return find_hashed(index, name, len, channel_hash(name, len));
+}
+
+static void grow(IN channel_index_t *index) {
+    size_t bucket_count = index->bucket_count * 2;
+    channel_t **buckets = calloc(bucket_count, sizeof(channel_t *));
+    if (!buckets) {
+        return;
+    }
+    for (size_t i = 0; i < index->bucket_count; i++) {
+        channel_t *channel = index->buckets[i];
+        while (channel) {
+            channel_t *next = channel->next;
+            size_t slot = channel->hash & (bucket_count - 1);
+            channel->next = buckets[slot];
+            buckets[slot] = channel;
+            channel = next;
+        }
+    }
+    free(index->buckets);
+    index->buckets = buckets;
+    index->bucket_count = bucket_count;
+}
+
+int channel_index_subscribe(IN channel_index_t *index,
+                            IN const char *name,
+                            IN size_t len,
+                            IN subscription_t *sub,
+                            IN void *owner) {
+    if (!index->buckets || !name || len == 0 || len > CHANNEL_NAME_MAX) {
+        return -1;
+    }
+    uint32_t hash = channel_hash(name, len);
+    channel_t *channel = find_hashed(index, name, len, hash);
+    if (!channel) {
+        channel = calloc(1, sizeof(channel_t) + len + 1);
+        if (!channel) {
+            return -1;
+        }
+        channel->hash = hash;
+        channel->name_len = len;
+        memcpy(channel->name, name, len);
+        size_t slot = hash & (index->bucket_count - 1);
+        channel->next = index->buckets[slot];
+        index->buckets[slot] = channel;
+        if (++index->channel_count > index->bucket_count * CHANNEL_INDEX_LOAD_FACTOR) {
+            grow(index);
+        }
+    }
+
+    sub->owner = owner;
+    sub->channel = channel;
+    sub->prev = NULL;
+    sub->next = channel->subscribers;
+    if (channel->subscribers) {
+        channel->subscribers->prev = sub;
+    }
+    channel->subscribers = sub;
+    channel->subscriber_count++;
+    return 0;
+}
+
+void channel_index_unsubscribe(IN channel_index_t *index, IN subscription_t *sub) {
+    channel_t *channel = sub->channel;
+    if (!channel) {
+        return;
+    }
+    if (sub->prev) {
+        sub->prev->next = sub->next;
+    } else {
+        channel->subscribers = sub->next;
+    }
+    if (sub->next) {
+        sub->next->prev = sub->prev;
+    }
+    sub->prev = sub->next = NULL;
+    sub->channel = NULL;
+
+    if (--channel->subscriber_count > 0) {
+        return;
+    }
+    channel_t **link = &index->buckets[channel->hash & (index->bucket_count - 1)];
+    while (*link && *link != channel) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = channel->next;
+        index->channel_count--;
+    }
+    free(channel);
+}
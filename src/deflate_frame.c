@@ -0,0 +1,107 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../inc/deflate_frame.h"
+#include "../inc/metrics.h"
+
+int deflate_frame_init(OUT deflate_frame_t *deflater, IN int level, IN size_t min_bytes) {
+    memset(deflater, 0, sizeof(*deflater));
+    deflater->min_bytes = min_bytes;
+    if (deflateInit2(&deflater->stream, level, Z_DEFLATED, -DEFLATE_FRAME_WINDOW_BITS,
+                     DEFLATE_FRAME_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+    deflater->ready = true;
+    return 0;
+}
+
+void deflate_frame_destroy(IN deflate_frame_t *deflater) {
+    if (deflater->ready) {
+        deflateEnd(&deflater->stream);
+        deflater->ready = false;
+    }
+}
+
+static bool compress_body(IN deflate_frame_t *deflater,
+                          IN payload_t *payload,
+                          OUT unsigned char *out,
+                          IN size_t cap,
+                          OUT size_t *out_len) {
+    z_stream *stream = &deflater->stream;
+
+    if (!deflater->ready || payload->len < deflater->min_bytes || payload->len > UINT_MAX || cap > UINT_MAX) {
+        return false;
+    }
+    deflateReset(stream);
+    stream->next_in = payload_data(payload);
+    stream->avail_in = (uInt)payload->len;
+    stream->next_out = out;
+    stream->avail_out = (uInt)cap;
+    if (deflate(stream, Z_SYNC_FLUSH) != Z_OK || stream->avail_in != 0 || stream->avail_out == 0) {
+        return false;
+    }
+    size_t produced = cap - stream->avail_out;
+    if (produced < DEFLATE_FRAME_TAIL_LEN || produced - DEFLATE_FRAME_TAIL_LEN >= payload->len) {
+        return false;
+    }
+    *out_len = produced - DEFLATE_FRAME_TAIL_LEN;
+    return true;
+}
+
+static unsigned char *put_header(IN unsigned char *body, IN size_t len, IN bool compressed) {
+    size_t header_len = len < DEFLATE_FRAME_LEN_16 ? 2 : len <= UINT16_MAX ? 4 : DEFLATE_FRAME_HEADER_MAX;
+    unsigned char *start = body - header_len;
+
+    start[0] = DEFLATE_FRAME_FIN | DEFLATE_FRAME_OPCODE_TEXT | (compressed ? DEFLATE_FRAME_RSV1 : 0);
+    if (header_len == 2) {
+        start[1] = (unsigned char)len;
+        return start;
+    }
+    start[1] = header_len == 4 ? DEFLATE_FRAME_LEN_16 : DEFLATE_FRAME_LEN_64;
+    for (size_t i = 2; i < header_len; i++) {
+        start[i] = (unsigned char)(len >> ((header_len - i - 1) * 8));
+    }
+    return start;
+}
+
+static payload_frame_t *build_frame(IN deflate_frame_t *deflater, IN payload_t *payload) {
+    size_t cap = deflateBound(&deflater->stream, payload->len) + DEFLATE_FRAME_HEADER_MAX;
+    size_t body_len = 0;
+    payload_frame_t *frame = malloc(sizeof(payload_frame_t) + DEFLATE_FRAME_HEADER_MAX + cap);
+
+    if (!frame) {
+        return NULL;
+    }
+    unsigned char *body = frame->buf + DEFLATE_FRAME_HEADER_MAX;
+    bool compressed = compress_body(deflater, payload, body, cap, &body_len);
+    if (compressed) {
+        metrics_add(METRIC_DEFLATE_FRAMES, 1);
+        metrics_add(METRIC_DEFLATE_IN_BYTES, payload->len);
+        metrics_add(METRIC_DEFLATE_OUT_BYTES, body_len);
+    } else {
+        body_len = payload->len;
+        memcpy(body, payload_data(payload), body_len);
+    }
+    frame->start = put_header(body, body_len, compressed);
+    frame->len = (size_t)(body - frame->start) + body_len;
+    return frame;
+}
+
+payload_frame_t *deflate_frame_get(IN deflate_frame_t *deflater, IN payload_t *payload) {
+    payload_frame_t *frame = atomic_load_explicit(&payload->frame, memory_order_acquire);
+    if (frame) {
+        return frame;
+    }
+    frame = build_frame(deflater, payload);
+    if (!frame) {
+        return NULL;
+    }
+    payload_frame_t *existing = NULL;
+    if (!atomic_compare_exchange_strong_explicit(&payload->frame, &existing, frame,
+                                                 memory_order_acq_rel, memory_order_acquire)) {
+        free(frame);
+        return existing;
+    }
+    return frame;
+}
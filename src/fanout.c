@@ -0,0 +1,324 @@
+#include <libwebsockets.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../inc/fanout.h"
+#include "../inc/log.h"
+#include "../inc/metrics.h"
+#include "../inc/payload.h"
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+}
+
+static void append_client(IN ws_shard_t *shard, IN session_t *pss) {
+    pss->prev = NULL;
+    pss->next = shard->clients;
+    if (shard->clients) {
+        shard->clients->prev = pss;
+    }
+    shard->clients = pss;
+}
+
+static void remove_client(IN ws_shard_t *shard, IN session_t *pss) {
+    if (pss->prev) {
+        pss->prev->next = pss->next;
+    } else if (shard->clients == pss) {
+        shard->clients = pss->next;
+    }
+    if (pss->next) {
+        pss->next->prev = pss->prev;
+    }
+    pss->prev = pss->next = NULL;
+}
+
+static void record_drop(IN session_t *pss, IN size_t len) {
+    pss->stats.dropped_messages++;
+    pss->stats.dropped_bytes += len;
+    metrics_add(METRIC_SESSION_DROPS, 1);
+    metrics_add(METRIC_SESSION_DROPPED_BYTES, len);
+}
+
+size_t fanout_pop(IN websocket_server_t *server, IN session_t *pss) {
+    size_t len = session_queue_pop(&pss->queue);
+    atomic_fetch_sub_explicit(&server->queued_bytes, len, memory_order_relaxed);
+    return len;
+}
+
+static bool over_byte_budget(IN websocket_server_t *server, IN session_t *pss, IN size_t len) {
+    const backlog_limits_t *limits = &server->limits;
+
+    if (limits->session_max_bytes && pss->queue.bytes + len > limits->session_max_bytes) {
+        return true;
+    }
+    if (limits->global_max_bytes &&
+        atomic_load_explicit(&server->queued_bytes, memory_order_relaxed) + len > limits->global_max_bytes) {
+        return true;
+    }
+    return false;
+}
+
+static bool over_budget(IN websocket_server_t *server, IN session_t *pss, IN size_t len) {
+    return session_queue_full(&pss->queue) || over_byte_budget(server, pss, len);
+}
+
+static void disconnect_slow_consumer(IN session_t *pss) {
+    if (pss->closing) {
+        return;
+    }
+    pss->closing = true;
+    LOG_WARN("Disconnecting slow consumer: %llu messages (%llu bytes) dropped",
+             (unsigned long long)pss->stats.dropped_messages,
+             (unsigned long long)pss->stats.dropped_bytes);
+    lws_close_reason(pss->wsi, LWS_CLOSE_STATUS_POLICY_VIOLATION, NULL, 0);
+    lws_set_timeout(pss->wsi, PENDING_TIMEOUT_USER_OK, LWS_TO_KILL_ASYNC);
+}
+
+static void apply_slow_consumer_policy(IN websocket_server_t *server,
+                                       IN session_t *pss,
+                                       IN size_t len) {
+    switch (server->limits.policy) {
+        case SLOW_CONSUMER_DROP_OLDEST:
+        case SLOW_CONSUMER_CONFLATE:
+            while (session_queue_count(&pss->queue) > 0 && over_budget(server, pss, len)) {
+                record_drop(pss, fanout_pop(server, pss));
+            }
+            break;
+
+        case SLOW_CONSUMER_DISCONNECT: {
+            uint64_t now = now_ms();
+            if (pss->over_budget_since_ms == 0) {
+                pss->over_budget_since_ms = now;
+            }
+            if (now - pss->over_budget_since_ms >= server->limits.grace_ms) {
+                disconnect_slow_consumer(pss);
+            }
+            break;
+        }
+
+        default:
+            break;
+    }
+}
+
+static void conflate_message(IN websocket_server_t *server, IN session_t *pss, IN const payload_t *payload) {
+    if (server->limits.policy != SLOW_CONSUMER_CONFLATE || session_queue_count(&pss->queue) == 0) {
+        return;
+    }
+    msg_t *msg = session_queue_find_key(&pss->queue, payload);
+    if (!msg) {
+        return;
+    }
+    size_t replaced_len = session_queue_remove(&pss->queue, msg);
+    atomic_fetch_sub_explicit(&server->queued_bytes, replaced_len, memory_order_relaxed);
+    pss->stats.conflated_messages++;
+    metrics_add(METRIC_SESSION_CONFLATED, 1);
+}
+
+static bool push_message(IN websocket_server_t *server,
+                         IN session_t *pss,
+                         IN payload_t *payload,
+                         IN uint64_t now_us) {
+    if (!session_queue_push(&pss->queue, payload_retain(payload), now_us)) {
+        payload_release(payload);
+        return false;
+    }
+    atomic_fetch_add_explicit(&server->queued_bytes, payload->len, memory_order_relaxed);
+    return true;
+}
+
+static bool enqueue_message(IN ws_shard_t *shard,
+                            IN session_t *pss,
+                            IN payload_t *payload,
+                            IN uint64_t now_us) {
+    websocket_server_t *server = shard->server;
+    size_t len = payload->len;
+
+    if (pss->closing || pss->replaying) {
+        return false;
+    }
+    if (pss->filter && !filter_match(&shard->filters, pss->filter, payload)) {
+        metrics_add(METRIC_FILTERED, 1);
+        return false;
+    }
+    conflate_message(server, pss, payload);
+    if (over_budget(server, pss, len)) {
+        apply_slow_consumer_policy(server, pss, len);
+        if (pss->closing || over_budget(server, pss, len)) {
+            record_drop(pss, len);
+            return false;
+        }
+    }
+    if (!push_message(server, pss, payload, now_us)) {
+        record_drop(pss, len);
+        return false;
+    }
+    lws_callback_on_writable(pss->wsi);
+    return true;
+}
+
+static int fanout_channel(IN ws_shard_t *shard,
+                          IN const char *name,
+                          IN size_t len,
+                          IN payload_t *payload,
+                          IN uint64_t now_us) {
+    int delivered = 0;
+    channel_t *channel = channel_index_find(&shard->channels, name, len);
+    if (!channel) {
+        return 0;
+    }
+    for (subscription_t *sub = channel->subscribers; sub; sub = sub->next) {
+        if (enqueue_message(shard, (session_t *)sub->owner, payload, now_us)) {
+            delivered++;
+        }
+    }
+    return delivered;
+}
+
+int fanout_broadcast(IN ws_shard_t *shard, IN payload_t *payload) {
+    if (!payload || payload->len == 0) {
+        return 0;
+    }
+    int delivered = 0;
+    uint64_t now_us = metrics_now_us();
+
+    metrics_record_since(METRIC_LATENCY_INBOX, payload->dispatch_us, now_us);
+    if (payload->channel_len > 0) {
+        delivered += fanout_channel(shard, payload->channel, payload->channel_len, payload, now_us);
+        delivered += fanout_channel(shard, CHANNEL_WILDCARD, strlen(CHANNEL_WILDCARD), payload, now_us);
+    } else {
+        for (session_t *pss = shard->clients; pss; pss = pss->next) {
+            if (enqueue_message(shard, pss, payload, now_us)) {
+                delivered++;
+            }
+        }
+    }
+    replay_ring_push(&shard->replay, payload);
+    metrics_add(METRIC_BROADCASTS, 1);
+    metrics_add(METRIC_FANOUT_DELIVERIES, (uint64_t)delivered);
+    return delivered;
+}
+
+static bool is_wildcard(IN const char *name, IN size_t len) {
+    return len == strlen(CHANNEL_WILDCARD) && memcmp(name, CHANNEL_WILDCARD, len) == 0;
+}
+
+static bool has_subscription(IN const session_t *pss, IN const char *name, IN size_t len) {
+    for (int i = 0; i < pss->subscription_count; i++) {
+        const channel_t *channel = pss->subscriptions[i].channel;
+        if (is_wildcard(channel->name, channel->name_len) ||
+            (channel->name_len == len && memcmp(channel->name, name, len) == 0)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool subscribed(IN ws_shard_t *shard, IN const session_t *pss, IN const payload_t *payload) {
+    if (pss->filter && !filter_match(&shard->filters, pss->filter, payload)) {
+        return false;
+    }
+    if (payload->channel_len == 0) {
+        return true;
+    }
+    return has_subscription(pss, payload->channel, payload->channel_len);
+}
+
+void fanout_resume(IN ws_shard_t *shard, IN session_t *pss, IN uint64_t last_seq, IN uint64_t epoch) {
+    const replay_ring_t *ring = &shard->replay;
+
+    pss->sequenced = true;
+    if (epoch != shard->server->epoch) {
+        metrics_add(METRIC_REPLAY_RESETS, 1);
+        return;
+    }
+    if (!ring->entries || ring->head == 0) {
+        return;
+    }
+    pss->replay_position = replay_ring_find(ring, last_seq);
+    pss->replaying = pss->replay_position < ring->head;
+    if (pss->replay_position == replay_ring_oldest(ring) &&
+        replay_ring_at(ring, pss->replay_position)->seq > last_seq + 1) {
+        metrics_add(METRIC_REPLAY_GAPS, 1);
+    }
+    if (pss->replaying) {
+        lws_callback_on_writable(pss->wsi);
+    }
+}
+
+void fanout_replay(IN ws_shard_t *shard, IN session_t *pss) {
+    const replay_ring_t *ring = &shard->replay;
+    uint64_t now_us = metrics_now_us();
+    uint64_t replayed = 0;
+
+    if (pss->replay_position < replay_ring_oldest(ring)) {
+        pss->replay_position = replay_ring_oldest(ring);
+        metrics_add(METRIC_REPLAY_GAPS, 1);
+    }
+    while (pss->replay_position < ring->head) {
+        payload_t *payload = replay_ring_at(ring, pss->replay_position);
+        if (subscribed(shard, pss, payload)) {
+            if (!over_budget(shard->server, pss, payload->len)) {
+                if (!push_message(shard->server, pss, payload, now_us)) {
+                    break;
+                }
+                replayed++;
+            } else if (session_queue_count(&pss->queue) > 0) {
+                break;
+            } else {
+                record_drop(pss, payload->len);
+            }
+        }
+        pss->replay_position++;
+    }
+    pss->replaying = pss->replay_position < ring->head;
+    metrics_add(METRIC_REPLAYED, replayed);
+}
+
+static void unsubscribe_all(IN ws_shard_t *shard, IN session_t *pss) {
+    for (int i = 0; i < pss->subscription_count; i++) {
+        channel_index_unsubscribe(&shard->channels, &pss->subscriptions[i]);
+    }
+    pss->subscription_count = 0;
+}
+
+void fanout_subscribe(IN ws_shard_t *shard, IN session_t *pss, IN const char *name, IN size_t len) {
+    if (has_subscription(pss, name, len)) {
+        return;
+    }
+    if (is_wildcard(name, len)) {
+        unsubscribe_all(shard, pss);
+    }
+    if (pss->subscription_count >= WEBSOCKET_MAX_CHANNELS) {
+        LOG_WARN("Ignoring subscription beyond %d channels", WEBSOCKET_MAX_CHANNELS);
+        return;
+    }
+    subscription_t *sub = &pss->subscriptions[pss->subscription_count];
+    if (channel_index_subscribe(&shard->channels, name, len, sub, pss) == 0) {
+        pss->subscription_count++;
+    }
+}
+
+int fanout_attach(IN ws_shard_t *shard, IN session_t *pss, IN struct lws *wsi) {
+    if (session_queue_init(&pss->queue, shard->server->limits.session_max_messages) != 0) {
+        return -1;
+    }
+    pss->wsi = wsi;
+    append_client(shard, pss);
+    metrics_gauge_add(METRIC_SESSIONS, 1);
+    return 0;
+}
+
+void fanout_detach(IN ws_shard_t *shard, IN session_t *pss) {
+    unsubscribe_all(shard, pss);
+    remove_client(shard, pss);
+    metrics_gauge_add(METRIC_SESSIONS, -1);
+    while (session_queue_count(&pss->queue) > 0) {
+        fanout_pop(shard->server, pss);
+    }
+    session_queue_destroy(&pss->queue);
+}
@@ -0,0 +1,312 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "../inc/filter.h"
+#include "../inc/log.h"
+
+static void set_value(OUT filter_value_t *value, IN const char *start, IN size_t len) {
+    char number[FILTER_VALUE_MAX];
+    char *end;
+
+    value->start = start;
+    value->len = len;
+    value->found = start != NULL;
+    value->numeric = false;
+    if (!start || len == 0 || len >= sizeof(number)) {
+        return;
+    }
+    memcpy(number, start, len);
+    number[len] = '\0';
+    value->number = strtod(number, &end);
+    value->numeric = *end == '\0';
+}
+
+static const char *skip_space(IN const char *p, IN const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+        p++;
+    }
+    return p;
+}
+
+static const char *skip_string(IN const char *p, IN const char *end) {
+    for (p++; p < end; p++) {
+        if (*p == '\\') {
+            p++;
+        } else if (*p == '"') {
+            return p + 1;
+        }
+    }
+    return NULL;
+}
+
+static const char *skip_value(IN const char *p, IN const char *end) {
+    int depth = 0;
+
+    while (p < end) {
+        if (*p == '"') {
+            p = skip_string(p, end);
+            if (!p) {
+                return NULL;
+            }
+            if (depth == 0) {
+                return p;
+            }
+            continue;
+        }
+        if (*p == '{' || *p == '[') {
+            depth++;
+        } else if (*p == '}' || *p == ']') {
+            if (depth == 0) {
+                return p;
+            }
+            if (--depth == 0) {
+                return p + 1;
+            }
+        } else if (depth == 0 && (*p == ',' || *p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+            return p;
+        }
+        p++;
+    }
+    return depth == 0 ? p : NULL;
+}
+
+static const char *find_member(IN const char *p, IN const char *end, IN const char *key, IN size_t key_len) {
+    p = skip_space(p, end);
+    if (p >= end || *p != '{') {
+        return NULL;
+    }
+    p = skip_space(p + 1, end);
+    while (p < end && *p == '"') {
+        const char *name = p + 1;
+        p = skip_string(p, end);
+        if (!p) {
+            return NULL;
+        }
+        bool match = (size_t)(p - 1 - name) == key_len && memcmp(name, key, key_len) == 0;
+        p = skip_space(p, end);
+        if (p >= end || *p != ':') {
+            return NULL;
+        }
+        p = skip_space(p + 1, end);
+        if (match) {
+            return p;
+        }
+        p = skip_value(p, end);
+        if (!p) {
+            return NULL;
+        }
+        p = skip_space(p, end);
+        if (p < end && *p == ',') {
+            p = skip_space(p + 1, end);
+        }
+    }
+    return NULL;
+}
+
+static void extract(IN const payload_t *payload, IN const char *path, IN size_t path_len, OUT filter_value_t *value) {
+    const char *p = (const char *)payload->buf + PAYLOAD_HEADROOM;
+    const char *end = p + payload->len;
+
+    while (p) {
+        const char *dot = memchr(path, FILTER_PATH_SEPARATOR, path_len);
+        size_t key_len = dot ? (size_t)(dot - path) : path_len;
+        p = find_member(p, end, path, key_len);
+        if (!dot) {
+            break;
+        }
+        path += key_len + 1;
+        path_len -= key_len + 1;
+    }
+    const char *stop = p ? skip_value(p, end) : NULL;
+    if (!stop) {
+        set_value(value, NULL, 0);
+    } else if (*p == '"') {
+        set_value(value, p + 1, (size_t)(stop - p) - 2);
+        value->numeric = false;
+    } else {
+        set_value(value, p, (size_t)(stop - p));
+    }
+}
+
+static const filter_value_t *field_value(IN filter_fields_t *fields, IN uint16_t field, IN const payload_t *payload) {
+    filter_cache_t *cache = &fields->cache[field];
+
+    if (cache->payload != payload || cache->seq != payload->seq) {
+        extract(payload, fields->fields[field].path, fields->fields[field].path_len, &cache->value);
+        cache->payload = payload;
+        cache->seq = payload->seq;
+    }
+    return &cache->value;
+}
+
+static uint16_t intern_field(IN filter_fields_t *fields, IN const char *path, IN size_t len) {
+    size_t free_slot = FILTER_MAX_FIELDS;
+
+    for (size_t i = 0; i < fields->field_count; i++) {
+        filter_field_t *field = &fields->fields[i];
+        if (field->refs == 0) {
+            if (free_slot == FILTER_MAX_FIELDS) {
+                free_slot = i;
+            }
+        } else if (field->path_len == len && memcmp(field->path, path, len) == 0) {
+            field->refs++;
+            return (uint16_t)i;
+        }
+    }
+    if (free_slot == FILTER_MAX_FIELDS) {
+        if (fields->field_count == FILTER_MAX_FIELDS) {
+            return FILTER_NO_FIELD;
+        }
+        free_slot = fields->field_count++;
+    }
+    filter_field_t *field = &fields->fields[free_slot];
+    memcpy(field->path, path, len);
+    field->path_len = len;
+    field->refs = 1;
+    fields->cache[free_slot].payload = NULL;
+    return (uint16_t)free_slot;
+}
+
+static bool parse_op(IN const char *clause, IN size_t len, OUT filter_op_t *op, OUT size_t *at, OUT size_t *op_len) {
+    for (size_t i = 0; i < len; i++) {
+        char c = clause[i];
+        bool equals = i + 1 < len && clause[i + 1] == '=';
+        *at = i;
+        *op_len = equals ? 2 : 1;
+        if (c == '!' && equals) {
+            *op = FILTER_NE;
+        } else if (c == '<') {
+            *op = equals ? FILTER_LE : FILTER_LT;
+        } else if (c == '>') {
+            *op = equals ? FILTER_GE : FILTER_GT;
+        } else if (c == '=') {
+            *op = FILTER_EQ;
+            *op_len = 1;
+        } else {
+            continue;
+        }
+        return true;
+    }
+    return false;
+}
+
+static bool parse_clause(IN filter_fields_t *fields, IN const char *clause, IN size_t len, OUT filter_clause_t *out) {
+    size_t at;
+    size_t op_len;
+
+    if (!parse_op(clause, len, &out->op, &at, &op_len) || at == 0 || at >= FILTER_PATH_MAX) {
+        return false;
+    }
+    size_t value_len = len - at - op_len;
+    if (value_len >= FILTER_VALUE_MAX) {
+        return false;
+    }
+    memcpy(out->text, clause + at + op_len, value_len);
+    out->text[value_len] = '\0';
+    set_value(&out->value, out->text, value_len);
+    if (out->op != FILTER_EQ && out->op != FILTER_NE && !out->value.numeric) {
+        return false;
+    }
+
+    out->field = FILTER_NO_FIELD;
+    if (at == strlen(FILTER_KEY_FIELD) && memcmp(clause, FILTER_KEY_FIELD, at) == 0) {
+        out->source = FILTER_SOURCE_KEY;
+    } else if (at == strlen(FILTER_CHANNEL_FIELD) && memcmp(clause, FILTER_CHANNEL_FIELD, at) == 0) {
+        out->source = FILTER_SOURCE_CHANNEL;
+    } else {
+        out->source = FILTER_SOURCE_JSON;
+        out->field = intern_field(fields, clause, at);
+        if (out->field == FILTER_NO_FIELD) {
+            LOG_WARN("Filter field limit of %d reached on this shard", FILTER_MAX_FIELDS);
+            return false;
+        }
+    }
+    return true;
+}
+
+filter_t *filter_compile(IN filter_fields_t *fields, IN const char *expr, IN size_t len) {
+    filter_t *filter = calloc(1, sizeof(filter_t) + FILTER_MAX_CLAUSES * sizeof(filter_clause_t));
+    if (!filter) {
+        return NULL;
+    }
+    while (len > 0) {
+        const char *end = memchr(expr, FILTER_CLAUSE_SEPARATOR, len);
+        size_t clause_len = end ? (size_t)(end - expr) : len;
+        if (clause_len > 0) {
+            if (filter->clause_count == FILTER_MAX_CLAUSES ||
+                !parse_clause(fields, expr, clause_len, &filter->clauses[filter->clause_count])) {
+                LOG_WARN("Rejecting filter clause %.*s", (int)clause_len, expr);
+                filter_destroy(fields, filter);
+                return NULL;
+            }
+            filter->clause_count++;
+        }
+        expr += clause_len;
+        len -= clause_len;
+        if (len > 0) {
+            expr++;
+            len--;
+        }
+    }
+    return filter;
+}
+
+void filter_destroy(IN filter_fields_t *fields, IN filter_t *filter) {
+    if (!filter) {
+        return;
+    }
+    for (int i = 0; i < filter->clause_count; i++) {
+        uint16_t field = filter->clauses[i].field;
+        if (field != FILTER_NO_FIELD) {
+            fields->fields[field].refs--;
+        }
+    }
+    free(filter);
+}
+
+static bool compare(IN const filter_clause_t *clause, IN const filter_value_t *value) {
+    const filter_value_t *expected = &clause->value;
+
+    if (!value->found) {
+        return clause->op == FILTER_NE;
+    }
+    if (clause->op == FILTER_EQ || clause->op == FILTER_NE) {
+        bool equal = value->numeric && expected->numeric
+                         ? value->number == expected->number
+                         : value->len == expected->len && memcmp(value->start, expected->start, value->len) == 0;
+        return equal == (clause->op == FILTER_EQ);
+    }
+    if (!value->numeric) {
+        return false;
+    }
+    switch (clause->op) {
+        case FILTER_LT:
+            return value->number < expected->number;
+        case FILTER_LE:
+            return value->number <= expected->number;
+        case FILTER_GT:
+            return value->number > expected->number;
+        default:
+            return value->number >= expected->number;
+    }
+}
+
+bool filter_match(IN filter_fields_t *fields, IN const filter_t *filter, IN const payload_t *payload) {
+    for (int i = 0; i < filter->clause_count; i++) {
+        const filter_clause_t *clause = &filter->clauses[i];
+        filter_value_t attribute;
+        const filter_value_t *value = &attribute;
+
+        if (clause->source == FILTER_SOURCE_KEY) {
+            set_value(&attribute, payload->key, payload->key_len);
+        } else if (clause->source == FILTER_SOURCE_CHANNEL) {
+            set_value(&attribute, payload->channel, payload->channel_len);
+        } else {
+            value = field_value(fields, clause->field, payload);
+        }
+        if (!compare(clause, value)) {
+            return false;
+        }
+    }
+    return true;
+}
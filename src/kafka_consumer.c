@@ -2,12 +2,27 @@
 #include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "../inc/kafka_consumer.h"
 #include "../inc/log.h"
 #include "../inc/message_queue.h"
+#include "../inc/metrics.h"
+#include "../inc/payload.h"
+
+static bool commit_on_broadcast(IN const config_t *cfg) {
+    const char *mode = cfg->kafka_commit_mode;
+
+    if (mode && strcmp(mode, KAFKA_COMMIT_BROADCAST) == 0) {
+        return true;
+    }
+    if (mode && mode[0] && strcmp(mode, KAFKA_COMMIT_AUTO) != 0) {
+        LOG_WARN("Unknown Kafka commit mode %s; committing automatically", mode);
+    }
+    return false;
+}
 
 static int configure_kafka(IN rd_kafka_conf_t *conf, IN const config_t *cfg) {
     char errstr[ERROR_STR_LEN];
@@ -23,100 +38,625 @@ static int configure_kafka(IN rd_kafka_conf_t *conf, IN const config_t *cfg) {
     if (rd_kafka_conf_set(conf, "enable.auto.commit", "true", errstr, sizeof(errstr)) != RD_KAFKA_CONF_OK) {
         LOG_WARN("Kafka config enable.auto.commit: %s", errstr);
     }
+    if (commit_on_broadcast(cfg)) {
+        char interval[KAFKA_CONF_VALUE_LEN];
+        snprintf(interval, sizeof(interval), "%d",
+                 cfg->kafka_commit_interval_ms > 0 ? cfg->kafka_commit_interval_ms : KAFKA_COMMIT_INTERVAL_MS);
+        if (rd_kafka_conf_set(conf, "enable.auto.offset.store", "false", errstr, sizeof(errstr)) != RD_KAFKA_CONF_OK ||
+            rd_kafka_conf_set(conf, "auto.commit.interval.ms", interval, errstr, sizeof(errstr)) != RD_KAFKA_CONF_OK) {
+            LOG_ERROR("Kafka config for commit-on-broadcast failed: %s", errstr);
+            return -1;
+        }
+    }
     if (rd_kafka_conf_set(conf, "auto.offset.reset", "latest", errstr, sizeof(errstr)) != RD_KAFKA_CONF_OK) {
         LOG_WARN("Kafka config auto.offset.reset: %s", errstr);
     }
     return 0;
 }
 
+static void free_routes(IN kafka_thread_args_t *args) {
+    for (size_t i = 0; i < args->route_count; i++) {
+        free(args->routes[i].topic);
+        free(args->routes[i].channel);
+    }
+    free(args->routes);
+}
+
+static int parse_routes(IN const config_t *cfg, OUT kafka_thread_args_t *args) {
+    const char *list = cfg->kafka_consumer_topics && cfg->kafka_consumer_topics[0] ? cfg->kafka_consumer_topics
+                                                                                 : cfg->kafka_consumer_topic;
+    size_t count = 1;
+
+    if (!list || !list[0]) {
+        return -1;
+    }
+    for (const char *p = list; *p; p++) {
+        count += *p == KAFKA_TOPIC_SEPARATOR;
+    }
+    args->routes = calloc(count, sizeof(kafka_route_t));
+    if (!args->routes) {
+        return -1;
+    }
+
+    const char *cursor = list;
+    while (*cursor) {
+        const char *end = strchr(cursor, KAFKA_TOPIC_SEPARATOR);
+        size_t len = end ? (size_t)(end - cursor) : strlen(cursor);
+        const char *separator = memchr(cursor, KAFKA_ROUTE_SEPARATOR, len);
+        size_t topic_len = separator ? (size_t)(separator - cursor) : len;
+
+        if (topic_len > 0) {
+            kafka_route_t *route = &args->routes[args->route_count++];
+            route->topic = strndup(cursor, topic_len);
+            if (separator && len > topic_len + 1) {
+                route->channel_len = len - topic_len - 1;
+                route->channel = strndup(separator + 1, route->channel_len);
+                if (!route->channel) {
+                    return -1;
+                }
+            }
+            if (!route->topic) {
+                return -1;
+            }
+            route->metrics_topic = metrics_register_topic(route->topic);
+        }
+        cursor += len;
+        if (*cursor == KAFKA_TOPIC_SEPARATOR) {
+            cursor++;
+        }
+    }
+    return args->route_count > 0 ? 0 : -1;
+}
+
+static int init_offsets(IN kafka_thread_args_t *args) {
+    const config_t *cfg = args->cfg;
+
+    if (!commit_on_broadcast(cfg)) {
+        return 0;
+    }
+    const char **topics = calloc(args->route_count, sizeof(const char *));
+    args->offsets = calloc(1, sizeof(offset_tracker_t));
+    if (!topics || !args->offsets) {
+        free(topics);
+        return -1;
+    }
+    for (size_t i = 0; i < args->route_count; i++) {
+        topics[i] = args->routes[i].topic;
+    }
+    int rc = offset_tracker_init(args->offsets, topics, args->route_count);
+    free(topics);
+    if (rc != 0) {
+        return -1;
+    }
+    args->commit_batch = cfg->kafka_commit_batch > 0 ? (uint64_t)cfg->kafka_commit_batch : KAFKA_COMMIT_BATCH;
+    LOG_INFO("Kafka offsets are committed after broadcast, every %d ms or %llu messages",
+             cfg->kafka_commit_interval_ms > 0 ? cfg->kafka_commit_interval_ms : KAFKA_COMMIT_INTERVAL_MS,
+             (unsigned long long)args->commit_batch);
+    return 0;
+}
+
+static void free_offsets(IN kafka_thread_args_t *args) {
+    if (args->offsets) {
+        offset_tracker_destroy(args->offsets);
+        free(args->offsets);
+        args->offsets = NULL;
+    }
+}
+
+static void flush_offsets(IN kafka_thread_args_t *args, IN bool sync) {
+    offset_tracker_t *tracker = args->offsets;
+
+    if (!tracker || !args->rk) {
+        return;
+    }
+    uint64_t tracked = atomic_load_explicit(&tracker->tracked, memory_order_relaxed);
+    uint64_t now_ms = metrics_now_us() / 1000u;
+    if (!sync && tracked - tracker->flushed < KAFKA_OFFSET_FLUSH_MESSAGES &&
+        now_ms - tracker->flushed_ms < KAFKA_OFFSET_FLUSH_MS) {
+        return;
+    }
+    tracker->flushed = tracked;
+    tracker->flushed_ms = now_ms;
+
+    rd_kafka_topic_partition_list_t *offsets = rd_kafka_topic_partition_list_new(KAFKA_OFFSET_LIST_SIZE);
+    if (!offsets) {
+        return;
+    }
+    if (offset_tracker_collect(tracker, offsets) > 0) {
+        rd_kafka_resp_err_t err = rd_kafka_offsets_store(args->rk, offsets);
+        if (err != RD_KAFKA_RESP_ERR_NO_ERROR && err != RD_KAFKA_RESP_ERR__STATE) {
+            LOG_WARN("Failed to store Kafka offsets: %s", rd_kafka_err2str(err));
+        }
+        metrics_add(METRIC_OFFSETS_STORED, (uint64_t)offsets->cnt);
+    }
+    rd_kafka_topic_partition_list_destroy(offsets);
+
+    if (sync || tracked - tracker->committed >= args->commit_batch) {
+        tracker->committed = tracked;
+        rd_kafka_resp_err_t err = rd_kafka_commit(args->rk, NULL, sync ? 0 : 1);
+        if (err != RD_KAFKA_RESP_ERR_NO_ERROR && err != RD_KAFKA_RESP_ERR__NO_OFFSET) {
+            LOG_WARN("Failed to commit Kafka offsets: %s", rd_kafka_err2str(err));
+        }
+        metrics_add(METRIC_OFFSET_COMMITS, 1);
+    }
+}
+
+static void store_offset(IN rd_kafka_t *rk, IN const rd_kafka_message_t *rkmessage) {
+    rd_kafka_topic_partition_list_t *offsets = rd_kafka_topic_partition_list_new(1);
+    if (!offsets) {
+        return;
+    }
+    rd_kafka_topic_partition_t *tp = rd_kafka_topic_partition_list_add(offsets, rd_kafka_topic_name(rkmessage->rkt),
+                                                                      rkmessage->partition);
+    if (tp) {
+        tp->offset = rkmessage->offset + 1;
+        rd_kafka_offsets_store(rk, offsets);
+    }
+    rd_kafka_topic_partition_list_destroy(offsets);
+}
+
+static size_t topic_index(IN const kafka_thread_args_t *args, IN const char *topic) {
+    for (size_t i = 0; i < args->route_count; i++) {
+        if (strcmp(args->routes[i].topic, topic) == 0) {
+            return i;
+        }
+    }
+    return args->route_count;
+}
+
+static void reset_offsets(IN kafka_thread_args_t *args, IN rd_kafka_topic_partition_list_t *partitions) {
+    for (int i = 0; i < partitions->cnt; i++) {
+        offset_tracker_reset(args->offsets, topic_index(args, partitions->elems[i].topic),
+                             partitions->elems[i].partition);
+    }
+}
+
+static const kafka_route_t *find_route(IN const kafka_thread_args_t *args, IN const rd_kafka_message_t *rkmessage) {
+    if (args->route_count == 1) {
+        return &args->routes[0];
+    }
+    const char *topic = rd_kafka_topic_name(rkmessage->rkt);
+    for (size_t i = 0; i < args->route_count; i++) {
+        if (strcmp(args->routes[i].topic, topic) == 0) {
+            return &args->routes[i];
+        }
+    }
+    return NULL;
+}
+
+static void forward_partitions(IN kafka_thread_args_t *args,
+                               IN rd_kafka_topic_partition_list_t *partitions,
+                               IN bool assign) {
+    if (args->worker_count == 0) {
+        return;
+    }
+    for (int i = 0; i < partitions->cnt; i++) {
+        rd_kafka_topic_partition_t *tp = &partitions->elems[i];
+        rd_kafka_queue_t *partition_queue = rd_kafka_queue_get_partition(args->rk, tp->topic, tp->partition);
+        if (!partition_queue) {
+            LOG_WARN("No queue for %s [%d]; it stays on the consumer thread", tp->topic, tp->partition);
+            continue;
+        }
+        kafka_worker_t *worker = &args->workers[args->next_worker++ % args->worker_count];
+        rd_kafka_queue_forward(partition_queue, assign ? worker->queue : NULL);
+        rd_kafka_queue_destroy(partition_queue);
+    }
+}
+
+static void rebalance(IN rd_kafka_t *rk,
+                      IN rd_kafka_resp_err_t err,
+                      IN rd_kafka_topic_partition_list_t *partitions,
+                      IN void *opaque) {
+    kafka_thread_args_t *args = (kafka_thread_args_t *)opaque;
+    bool cooperative = strcmp(rd_kafka_rebalance_protocol(rk), KAFKA_REBALANCE_COOPERATIVE) == 0;
+    bool assign = err == RD_KAFKA_RESP_ERR__ASSIGN_PARTITIONS;
+    rd_kafka_error_t *error = NULL;
+
+    if (args->offsets) {
+        if (!assign) {
+            flush_offsets(args, true);
+        }
+        reset_offsets(args, partitions);
+    }
+    if (assign) {
+        forward_partitions(args, partitions, true);
+    }
+    if (cooperative) {
+        error = assign ? rd_kafka_incremental_assign(rk, partitions)
+                       : rd_kafka_incremental_unassign(rk, partitions);
+    } else if (rd_kafka_assign(rk, assign ? partitions : NULL) != RD_KAFKA_RESP_ERR_NO_ERROR) {
+        LOG_WARN("Kafka %s failed", assign ? "assign" : "unassign");
+    }
+    if (error) {
+        LOG_WARN("Kafka incremental %s failed: %s", assign ? "assign" : "unassign", rd_kafka_error_string(error));
+        rd_kafka_error_destroy(error);
+    }
+    if (assign && args->flow.paused && rd_kafka_pause_partitions(rk, partitions) != RD_KAFKA_RESP_ERR_NO_ERROR) {
+        LOG_WARN("Failed to pause %d newly assigned Kafka partitions", partitions->cnt);
+    }
+    if (!assign) {
+        forward_partitions(args, partitions, false);
+    }
+    LOG_INFO("Kafka %s %d partitions across %d workers",
+             assign ? "assigned" : "revoked", partitions->cnt, args->worker_count);
+}
+
+static void stop_workers(IN kafka_thread_args_t *args) {
+    for (int i = 0; i < args->worker_count; i++) {
+        if (args->workers[i].started) {
+            pthread_join(args->workers[i].thread, NULL);
+            args->workers[i].started = false;
+        }
+    }
+}
+
 static void cleanup_consumer(IN rd_kafka_t *rk,
                              IN rd_kafka_topic_partition_list_t *topics,
                              IN kafka_thread_args_t *args) {
     if (topics) {
         rd_kafka_topic_partition_list_destroy(topics);
     }
+    stop_workers(args);
+    flush_offsets(args, true);
     if (rk) {
         rd_kafka_consumer_close(rk);
+    }
+    for (int i = 0; i < args->worker_count; i++) {
+        if (args->workers[i].queue) {
+            rd_kafka_queue_destroy(args->workers[i].queue);
+        }
+    }
+    if (rk) {
         rd_kafka_destroy(rk);
     }
+    free(args->workers);
+    free_offsets(args);
+    free_routes(args);
     free(args);
 }
 
+static bool is_message_error(IN rd_kafka_message_t *rkmessage) {
+    if (!rkmessage->err) {
+        return false;
+    }
+    if (rkmessage->err != RD_KAFKA_RESP_ERR__PARTITION_EOF &&
+        rkmessage->err != RD_KAFKA_RESP_ERR__TIMED_OUT) {
+        LOG_WARN("Kafka error: %s", rd_kafka_message_errstr(rkmessage));
+    }
+    return true;
+}
+
+static size_t batch_size(IN const kafka_thread_args_t *args) {
+    if (args->cfg->kafka_consumer_batch_size > 1) {
+        return (size_t)args->cfg->kafka_consumer_batch_size;
+    }
+    return args->worker_count > 0 ? KAFKA_WORKER_DEFAULT_BATCH : 1;
+}
+
+static void init_flow_control(IN const kafka_thread_args_t *args, OUT flow_control_t *flow) {
+    const config_t *cfg = args->cfg;
+    size_t capacity = args->queue->capacity;
+    size_t headroom = batch_size(args) * (size_t)(args->worker_count > 0 ? args->worker_count : 1);
+    int high = cfg->kafka_pause_watermark;
+    int low = cfg->kafka_resume_watermark > 0 ? cfg->kafka_resume_watermark : high / 2;
+
+    memset(flow, 0, sizeof(*flow));
+    if (high <= 0 || high > KAFKA_PERCENT || capacity <= headroom) {
+        return;
+    }
+    flow->enabled = true;
+    flow->high = capacity * (size_t)high / KAFKA_PERCENT;
+    if (flow->high > capacity - headroom) {
+        flow->high = capacity - headroom;
+    }
+    flow->low = capacity * (size_t)(low < high ? low : high) / KAFKA_PERCENT;
+    if (flow->low >= flow->high) {
+        flow->low = flow->high / 2;
+    }
+    LOG_INFO("Kafka consumer flow control: pause at %zu, resume at %zu of %zu queued messages",
+             flow->high, flow->low, capacity);
+}
+
+static bool set_paused(IN rd_kafka_t *rk, IN bool paused) {
+    rd_kafka_topic_partition_list_t *partitions = NULL;
+    rd_kafka_resp_err_t err = rd_kafka_assignment(rk, &partitions);
+
+    if (err == RD_KAFKA_RESP_ERR_NO_ERROR && partitions) {
+        err = paused ? rd_kafka_pause_partitions(rk, partitions)
+                     : rd_kafka_resume_partitions(rk, partitions);
+    }
+    if (partitions) {
+        rd_kafka_topic_partition_list_destroy(partitions);
+    }
+    if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+        LOG_WARN("Failed to %s Kafka partitions: %s", paused ? "pause" : "resume", rd_kafka_err2str(err));
+        return false;
+    }
+    return true;
+}
+
+static void update_flow_control(IN rd_kafka_t *rk, IN message_queue_t *queue, IN flow_control_t *flow) {
+    if (!flow->enabled) {
+        return;
+    }
+    size_t depth = message_queue_size(queue);
+    if (!flow->paused && depth >= flow->high && set_paused(rk, true)) {
+        flow->paused = true;
+        metrics_add(METRIC_CONSUMER_PAUSES, 1);
+        metrics_gauge_add(METRIC_CONSUMER_PAUSED, 1);
+        LOG_INFO("Consumer queue at %zu/%zu; pausing Kafka partitions", depth, queue->capacity);
+    } else if (flow->paused && depth <= flow->low && set_paused(rk, false)) {
+        flow->paused = false;
+        metrics_gauge_add(METRIC_CONSUMER_PAUSED, -1);
+        LOG_INFO("Consumer queue at %zu/%zu; resuming Kafka partitions", depth, queue->capacity);
+    }
+}
+
+static int poll_timeout(IN const flow_control_t *flow, IN int timeout_ms) {
+    return flow->paused && timeout_ms > KAFKA_PAUSED_POLL_MS ? KAFKA_PAUSED_POLL_MS : timeout_ms;
+}
+
+static void record_consumed(IN const kafka_thread_args_t *args, IN rd_kafka_message_t *rkmessage, IN uint64_t *consumed) {
+    int64_t low;
+    int64_t high;
+
+    metrics_add(METRIC_KAFKA_CONSUMED, 1);
+    metrics_add(METRIC_KAFKA_CONSUMED_BYTES, rkmessage->len);
+    if ((*consumed)++ % KAFKA_LAG_SAMPLE_INTERVAL != 0) {
+        return;
+    }
+    const kafka_route_t *route = find_route(args, rkmessage);
+    if (route && rd_kafka_get_watermark_offsets(args->rk, rd_kafka_topic_name(rkmessage->rkt), rkmessage->partition,
+                                                &low, &high) == RD_KAFKA_RESP_ERR_NO_ERROR) {
+        metrics_set_partition_lag(route->metrics_topic, rkmessage->partition, high - rkmessage->offset - 1);
+    }
+}
+
+static payload_t *payload_from_message(IN const kafka_thread_args_t *args, IN rd_kafka_message_t *rkmessage) {
+    const config_t *cfg = args->cfg;
+    const kafka_route_t *route = find_route(args, rkmessage);
+    rd_kafka_headers_t *headers = NULL;
+    const void *channel = rkmessage->key;
+    size_t channel_len = rkmessage->key_len;
+
+    if (route && route->channel) {
+        channel = route->channel;
+        channel_len = route->channel_len;
+    } else if (cfg->kafka_channel_header && cfg->kafka_channel_header[0]) {
+        if (rd_kafka_message_headers(rkmessage, &headers) != RD_KAFKA_RESP_ERR_NO_ERROR ||
+            rd_kafka_header_get_last(headers, cfg->kafka_channel_header,
+                                     &channel, &channel_len) != RD_KAFKA_RESP_ERR_NO_ERROR) {
+            channel = NULL;
+            channel_len = 0;
+        }
+    }
+    payload_t *payload = payload_create_routed((const char *)rkmessage->payload, rkmessage->len,
+                                               (const char *)rkmessage->key, rkmessage->key_len,
+                                               (const char *)channel, channel_len);
+    if (payload) {
+        payload->source_ts_ms = rd_kafka_message_timestamp(rkmessage, NULL);
+        if (args->offsets &&
+            (!route || !offset_tracker_track(args->offsets, payload, (size_t)(route - args->routes),
+                                             rkmessage->partition, rkmessage->offset))) {
+            store_offset(args->rk, rkmessage);
+        }
+    }
+    return payload;
+}
+
+static void consume_messages(IN kafka_thread_args_t *args) {
+    rd_kafka_t *rk = args->rk;
+    const config_t *cfg = args->cfg;
+    message_queue_t *queue = args->queue;
+    volatile sig_atomic_t *running = args->running;
+    rd_kafka_message_t *rkmessage;
+    uint64_t consumed = 0;
+    flow_control_t *flow = &args->flow;
+
+    init_flow_control(args, flow);
+    while (*running) {
+        update_flow_control(rk, queue, flow);
+        flush_offsets(args, false);
+        rkmessage = rd_kafka_consumer_poll(rk, poll_timeout(flow, cfg->kafka_poll_timeout_ms));
+        if (!rkmessage) {
+            continue;
+        }
+
+        if (!is_message_error(rkmessage) && rkmessage->payload && rkmessage->len > 0) {
+            record_consumed(args, rkmessage, &consumed);
+            payload_t *payload = payload_from_message(args, rkmessage);
+            if (!payload || !message_queue_push_payload(queue, payload)) {
+                payload_release(payload);
+                metrics_add(METRIC_CONSUMER_QUEUE_DROPS, 1);
+                LOG_WARN("%s", "Dropping Kafka message; queue unavailable");
+            }
+        }
+
+        rd_kafka_message_destroy(rkmessage);
+    }
+}
+
+static int consume_batches(IN kafka_thread_args_t *args,
+                           IN rd_kafka_queue_t *rkqu,
+                           IN flow_control_t *flow) {
+    rd_kafka_t *rk = args->rk;
+    const config_t *cfg = args->cfg;
+    message_queue_t *queue = args->queue;
+    volatile sig_atomic_t *running = args->running;
+    size_t max = batch_size(args);
+    int wait_ms = cfg->kafka_consumer_batch_wait_ms > 0 ? cfg->kafka_consumer_batch_wait_ms
+                                                         : cfg->kafka_poll_timeout_ms;
+    rd_kafka_message_t **rkmessages = calloc(max, sizeof(rd_kafka_message_t *));
+    payload_t **payloads = calloc(max, sizeof(payload_t *));
+    uint64_t consumed = 0;
+
+    if (!rkqu || !rkmessages || !payloads) {
+        free(rkmessages);
+        free(payloads);
+        return -1;
+    }
+
+    while (*running) {
+        size_t count = 0;
+        if (flow) {
+            update_flow_control(rk, queue, flow);
+            flush_offsets(args, false);
+        }
+        ssize_t received = rd_kafka_consume_batch_queue(rkqu, flow ? poll_timeout(flow, wait_ms) : wait_ms,
+                                                        rkmessages, max);
+        if (received < 0) {
+            LOG_WARN("Kafka batch consume failed: %s", rd_kafka_err2str(rd_kafka_last_error()));
+            continue;
+        }
+
+        for (ssize_t i = 0; i < received; i++) {
+            rd_kafka_message_t *rkmessage = rkmessages[i];
+            if (!is_message_error(rkmessage) && rkmessage->payload && rkmessage->len > 0) {
+                record_consumed(args, rkmessage, &consumed);
+                payloads[count] = payload_from_message(args, rkmessage);
+                if (payloads[count]) {
+                    count++;
+                } else {
+                    metrics_add(METRIC_CONSUMER_QUEUE_DROPS, 1);
+                    LOG_WARN("%s", "Dropping Kafka message; payload allocation failed");
+                }
+            }
+            rd_kafka_message_destroy(rkmessage);
+        }
+
+        size_t pushed = message_queue_push_batch(queue, payloads, count);
+        if (pushed < count) {
+            metrics_add(METRIC_CONSUMER_QUEUE_DROPS, count - pushed);
+            LOG_WARN("Dropping %zu Kafka messages; queue unavailable", count - pushed);
+            for (size_t i = pushed; i < count; i++) {
+                payload_release(payloads[i]);
+            }
+        }
+    }
+
+    free(rkmessages);
+    free(payloads);
+    return 0;
+}
+
+static void *kafka_worker_thread(IN void *arg) {
+    kafka_worker_t *worker = (kafka_worker_t *)arg;
+
+    if (consume_batches(worker->args, worker->queue, NULL) != 0) {
+        LOG_ERROR("%s", "Failed to set up Kafka partition worker");
+    }
+    return NULL;
+}
+
+static void start_workers(IN kafka_thread_args_t *args) {
+    int count = args->cfg->kafka_consumer_workers;
+
+    if (count <= 1) {
+        return;
+    }
+    args->workers = calloc((size_t)count, sizeof(kafka_worker_t));
+    if (!args->workers) {
+        LOG_ERROR("%s", "Failed to allocate Kafka partition workers; consuming on one thread");
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        kafka_worker_t *worker = &args->workers[i];
+        worker->args = args;
+        worker->queue = rd_kafka_queue_new(args->rk);
+        if (!worker->queue || pthread_create(&worker->thread, NULL, kafka_worker_thread, worker) != 0) {
+            LOG_ERROR("Failed to start Kafka partition worker %d; continuing with %d", i, i);
+            if (worker->queue) {
+                rd_kafka_queue_destroy(worker->queue);
+            }
+            break;
+        }
+        worker->started = true;
+        args->worker_count++;
+    }
+}
+
+static void consume(IN kafka_thread_args_t *args) {
+    if (args->worker_count > 0 || args->cfg->kafka_consumer_batch_size <= 1) {
+        consume_messages(args);
+        return;
+    }
+    rd_kafka_queue_t *rkqu = rd_kafka_queue_get_consumer(args->rk);
+    init_flow_control(args, &args->flow);
+    if (consume_batches(args, rkqu, &args->flow) != 0) {
+        LOG_ERROR("%s", "Failed to set up Kafka batch consumer; falling back to single messages");
+        consume_messages(args);
+    }
+    if (rkqu) {
+        rd_kafka_queue_destroy(rkqu);
+    }
+}
+
 static void *kafka_consumer_thread(IN void *arg) {
     char errstr[ERROR_STR_LEN];
     rd_kafka_t *rk;
     rd_kafka_topic_partition_list_t *topics;
-    rd_kafka_message_t *rkmessage;
     kafka_thread_args_t *args = (kafka_thread_args_t *)arg;
     const config_t *cfg = args->cfg;
-    message_queue_t *queue = args->queue;
-    volatile sig_atomic_t *running = args->running;
     rd_kafka_conf_t *conf = rd_kafka_conf_new();
     
     if (configure_kafka(conf, cfg) != 0) {
         rd_kafka_conf_destroy(conf);
-        free(args);
+        cleanup_consumer(NULL, NULL, args);
         return NULL;
     }
+    if (init_offsets(args) != 0) {
+        LOG_ERROR("%s", "Failed to allocate Kafka offset tracker");
+        rd_kafka_conf_destroy(conf);
+        cleanup_consumer(NULL, NULL, args);
+        return NULL;
+    }
+    if (cfg->kafka_consumer_workers > 1 || args->offsets || cfg->kafka_pause_watermark > 0) {
+        rd_kafka_conf_set_rebalance_cb(conf, rebalance);
+        rd_kafka_conf_set_opaque(conf, args);
+    }
 
     rk = rd_kafka_new(RD_KAFKA_CONSUMER, conf, errstr, sizeof(errstr));
     if (!rk) {
         LOG_ERROR("Failed to create Kafka consumer: %s", errstr);
         rd_kafka_conf_destroy(conf);
-        free(args);
+        cleanup_consumer(NULL, NULL, args);
         return NULL;
     }
+    args->rk = rk;
 
     rd_kafka_poll_set_consumer(rk);
 
-    topics = rd_kafka_topic_partition_list_new(KAFKA_PARTITION_LIST);
+    topics = rd_kafka_topic_partition_list_new((int)args->route_count);
     if (!topics) {
         LOG_ERROR("%s", "Failed to allocate topic partition list");
         cleanup_consumer(rk, topics, args);
         return NULL;
     }
     
-
-    if (!rd_kafka_topic_partition_list_add(topics, cfg->kafka_consumer_topic, RD_KAFKA_PARTITION_UA)) {
-        LOG_ERROR("Failed to add topic %s to partition list", cfg->kafka_consumer_topic);
-        cleanup_consumer(rk, topics, args);
-        return NULL;
+    for (size_t i = 0; i < args->route_count; i++) {
+        if (!rd_kafka_topic_partition_list_add(topics, args->routes[i].topic, RD_KAFKA_PARTITION_UA)) {
+            LOG_ERROR("Failed to add topic %s to partition list", args->routes[i].topic);
+            cleanup_consumer(rk, topics, args);
+            return NULL;
+        }
     }
 
     if (rd_kafka_subscribe(rk, topics) != RD_KAFKA_RESP_ERR_NO_ERROR) {
-        LOG_ERROR("Failed to subscribe to topic %s", cfg->kafka_consumer_topic);
+        LOG_ERROR("%s", "Failed to subscribe to Kafka consumer topics");
         cleanup_consumer(rk, topics, args);
         return NULL;
     }
     rd_kafka_topic_partition_list_destroy(topics);
     topics = NULL;
+    start_workers(args);
 
-    LOG_INFO("Kafka consumer started for topic %s", cfg->kafka_consumer_topic);
-
-    while (*running) {
-        rkmessage = rd_kafka_consumer_poll(rk, cfg->kafka_poll_timeout_ms);
-        if (!rkmessage) {
-            continue;
-        }
-
-        if (rkmessage->err) {
-            if (rkmessage->err != RD_KAFKA_RESP_ERR__PARTITION_EOF &&
-                rkmessage->err != RD_KAFKA_RESP_ERR__TIMED_OUT) {
-                LOG_WARN("Kafka error: %s", rd_kafka_message_errstr(rkmessage));
-            }
-            rd_kafka_message_destroy(rkmessage);
-            continue;
-        }
-
-        if (rkmessage->payload && rkmessage->len > 0) {
-            if (!message_queue_push(queue, (const char *)rkmessage->payload, rkmessage->len)) {
-                LOG_WARN("%s", "Dropping Kafka message; queue unavailable");
-            }
-        }
-
-        rd_kafka_message_destroy(rkmessage);
+    for (size_t i = 0; i < args->route_count; i++) {
+        LOG_INFO("Kafka consumer started for topic %s -> channel %s", args->routes[i].topic,
+                 args->routes[i].channel ? args->routes[i].channel : "(message key)");
     }
 
+    consume(args);
+
     LOG_INFO("%s", "Shutting down Kafka consumer");
     cleanup_consumer(rk, topics, args);
     return NULL;
@@ -141,8 +681,15 @@ int kafka_consumer_start(IN kafka_consumer_t *consumer,
     args->cfg = cfg;
     args->queue = queue;
     args->running = running_flag;
+    if (parse_routes(cfg, args) != 0) {
+        LOG_ERROR("%s", "No Kafka consumer topics configured");
+        free_routes(args);
+        free(args);
+        return -1;
+    }
 
     if (pthread_create(&consumer->thread, NULL, kafka_consumer_thread, args) != 0) {
+        free_routes(args);
         free(args);
         return -1;
     }
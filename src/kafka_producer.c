@@ -1,25 +1,112 @@
 #include <librdkafka/rdkafka.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
 #include "../inc/kafka_producer.h"
 #include "../inc/log.h"
 #include "../inc/message_queue.h"
+#include "../inc/metrics.h"
+#include "../inc/payload.h"
+
+static bool spill_payload(IN spill_log_t *spill, IN payload_t *payload) {
+    if (spill_log_append(spill, (const char *)payload_data(payload), payload->len)) {
+        metrics_add(METRIC_SPILLED, 1);
+        return true;
+    }
+    metrics_add(METRIC_SPILL_DROPS, 1);
+    LOG_WARN("%s", "Spill log full; dropping message for Kafka");
+    return false;
+}
+
+static bool retriable(IN rd_kafka_resp_err_t err) {
+    return err == RD_KAFKA_RESP_ERR__MSG_TIMED_OUT ||
+           err == RD_KAFKA_RESP_ERR__TRANSPORT ||
+           err == RD_KAFKA_RESP_ERR__QUEUE_FULL ||
+           err == RD_KAFKA_RESP_ERR__PURGE_QUEUE ||
+           err == RD_KAFKA_RESP_ERR__PURGE_INFLIGHT;
+}
+
+static void replay_settled(IN spill_replay_t *replay, IN rd_kafka_resp_err_t err) {
+    bool delivered = !err || !retriable(err);
+
+    if (spill_log_ack(replay->log, delivered)) {
+        replay->backoff_ms = replay->backoff_ms ? replay->backoff_ms * 2 : KAFKA_SPILL_RETRY_MIN_MS;
+        if (replay->backoff_ms > KAFKA_SPILL_RETRY_MAX_MS) {
+            replay->backoff_ms = KAFKA_SPILL_RETRY_MAX_MS;
+        }
+        replay->resume_us = metrics_now_us() + replay->backoff_ms * 1000;
+        LOG_WARN("Spill replay failed: %s; retrying in %llu ms",
+                 rd_kafka_err2str(err), (unsigned long long)replay->backoff_ms);
+    } else if (spill_log_in_flight(replay->log) == 0) {
+        replay->backoff_ms = 0;
+    }
+}
+
+static bool keep_for_retry(IN spill_replay_t *replay, IN payload_t *payload, IN rd_kafka_resp_err_t err) {
+    if (!replay->log || !retriable(err)) {
+        return false;
+    }
+    return payload->spilled || spill_payload(replay->log, payload);
+}
 
 static void delivery_report(IN rd_kafka_t *rk,
                             IN const rd_kafka_message_t *rkmessage,
                             IN void *opaque) {
+    spill_replay_t *replay = (spill_replay_t *)opaque;
+    payload_t *payload = (payload_t *)rkmessage->_private;
+
     (void)rk;
-    (void)opaque;
-    if (rkmessage->err) {
+    if (!rkmessage->err) {
+        int64_t latency = rd_kafka_message_latency(rkmessage);
+        metrics_add(METRIC_PRODUCER_DELIVERED, 1);
+        metrics_add(METRIC_PRODUCER_LATENCY_US, latency > 0 ? (uint64_t)latency : 0);
+        metrics_record(METRIC_LATENCY_PRODUCE_TO_ACK, latency > 0 ? (uint64_t)latency : 0);
+    } else if (!keep_for_retry(replay, payload, rkmessage->err)) {
+        metrics_add(METRIC_PRODUCER_DELIVERY_FAILURES, 1);
         LOG_WARN("Kafka delivery failed: %s", rd_kafka_message_errstr(rkmessage));
     }
+    if (payload->spilled) {
+        replay_settled(replay, rkmessage->err);
+    }
+    payload_release(payload);
 }
 
-static int configure_kafka(IN rd_kafka_conf_t *conf, IN const config_t *cfg) {
+static void resolve_profile(IN const config_t *cfg, OUT producer_profile_t *profile) {
+    bool throughput = cfg->kafka_producer_profile &&
+                      strcmp(cfg->kafka_producer_profile, KAFKA_PRODUCER_PROFILE_THROUGHPUT) == 0;
+
+    profile->linger_ms = throughput ? KAFKA_PRODUCER_THROUGHPUT_LINGER_MS : KAFKA_PRODUCER_LATENCY_LINGER_MS;
+    profile->batch_bytes = throughput ? KAFKA_PRODUCER_THROUGHPUT_BATCH_BYTES : 0;
+    profile->compression = throughput ? KAFKA_PRODUCER_THROUGHPUT_COMPRESSION : KAFKA_PRODUCER_LATENCY_COMPRESSION;
+
+    if (cfg->kafka_producer_linger_ms > 0) {
+        profile->linger_ms = cfg->kafka_producer_linger_ms;
+    }
+    if (cfg->kafka_producer_batch_bytes > 0) {
+        profile->batch_bytes = cfg->kafka_producer_batch_bytes;
+    }
+    if (cfg->kafka_producer_compression && cfg->kafka_producer_compression[0]) {
+        profile->compression = cfg->kafka_producer_compression;
+    }
+}
+
+static void set_optional(IN rd_kafka_conf_t *conf, IN const char *name, IN const char *value) {
+    char errstr[ERROR_STR_LEN];
+
+    if (rd_kafka_conf_set(conf, name, value, errstr, sizeof(errstr)) != RD_KAFKA_CONF_OK) {
+        LOG_WARN("Kafka producer config %s=%s: %s", name, value, errstr);
+    }
+}
+
+static int configure_kafka(IN rd_kafka_conf_t *conf, IN const config_t *cfg, IN spill_replay_t *replay) {
     char errstr[ERROR_STR_LEN];
 
     if (rd_kafka_conf_set(conf, "bootstrap.servers", cfg->kafka_brokers, errstr, sizeof(errstr)) != RD_KAFKA_CONF_OK) {
@@ -27,12 +114,25 @@ static int configure_kafka(IN rd_kafka_conf_t *conf, IN const config_t *cfg) {
         return -1;
     }
 
-    rd_kafka_conf_set(conf, "acks", "1", NULL, 0);
-    rd_kafka_conf_set(conf, "linger.ms", "0", NULL, 0);
-    rd_kafka_conf_set(conf, "batch.size", "0", NULL, 0);
+    producer_profile_t profile;
+    char value[KAFKA_CONF_VALUE_LEN];
+    resolve_profile(cfg, &profile);
+
+    set_optional(conf, "acks", "1");
+    snprintf(value, sizeof(value), "%d", profile.linger_ms);
+    set_optional(conf, "linger.ms", value);
+    if (profile.batch_bytes > 0) {
+        snprintf(value, sizeof(value), "%d", profile.batch_bytes);
+        set_optional(conf, "batch.size", value);
+    }
+    set_optional(conf, "compression.codec", profile.compression);
+
+    LOG_INFO("Kafka producer profile: linger.ms=%d batch.size=%d compression=%s",
+             profile.linger_ms, profile.batch_bytes, profile.compression);
 
     rd_kafka_conf_set_log_cb(conf, NULL);
     rd_kafka_conf_set_dr_msg_cb(conf, delivery_report);
+    rd_kafka_conf_set_opaque(conf, replay);
 
     return 0;
 }
@@ -42,6 +142,8 @@ static void cleanup_producer(IN rd_kafka_t *rk,
                              IN producer_thread_args_t *args) {
     if (rk) {
         rd_kafka_flush(rk, KAFKA_PRODUCER_FLUSH);
+        rd_kafka_purge(rk, RD_KAFKA_PURGE_F_QUEUE | RD_KAFKA_PURGE_F_INFLIGHT);
+        rd_kafka_poll(rk, 0);
         if (topic) {
             rd_kafka_topic_destroy(topic);
         }
@@ -50,17 +152,158 @@ static void cleanup_producer(IN rd_kafka_t *rk,
     free(args);
 }
 
+static int enable_kafka_wakeup(IN rd_kafka_t *rk, OUT rd_kafka_queue_t **main_queue) {
+    uint64_t one = 1;
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    *main_queue = rd_kafka_queue_get_main(rk);
+    rd_kafka_queue_io_event_enable(*main_queue, fd, &one, sizeof(one));
+    return fd;
+}
+
+static void disable_kafka_wakeup(IN rd_kafka_queue_t *main_queue, IN int fd) {
+    if (main_queue) {
+        rd_kafka_queue_io_event_enable(main_queue, -1, NULL, 0);
+        rd_kafka_queue_destroy(main_queue);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+static void wait_for_work(IN message_queue_t *queue, IN int kafka_fd, IN int timeout_ms) {
+    uint64_t count;
+    struct pollfd fds[KAFKA_PRODUCER_WAIT_FDS] = {
+        {.fd = message_queue_event_fd(queue), .events = POLLIN},
+        {.fd = kafka_fd, .events = POLLIN}
+    };
+
+    if (poll(fds, KAFKA_PRODUCER_WAIT_FDS, timeout_ms > 0 ? timeout_ms : -1) <= 0) {
+        return;
+    }
+    if ((fds[1].revents & POLLIN) && read(kafka_fd, &count, sizeof(count)) < 0) {
+        LOG_WARN("%s", "Failed to reset Kafka producer wakeup");
+    }
+}
+
+static int create_burst(IN const config_t *cfg, OUT producer_burst_t *burst) {
+    burst->capacity = cfg->kafka_producer_burst > 0 ? (size_t)cfg->kafka_producer_burst
+                                                    : KAFKA_PRODUCER_DEFAULT_BURST;
+    burst->payloads = calloc(burst->capacity, sizeof(payload_t *));
+    burst->rkmessages = calloc(burst->capacity, sizeof(rd_kafka_message_t));
+    if (!burst->payloads || !burst->rkmessages) {
+        free(burst->payloads);
+        free(burst->rkmessages);
+        return -1;
+    }
+    return 0;
+}
+
+static void destroy_burst(IN producer_burst_t *burst) {
+    free(burst->payloads);
+    free(burst->rkmessages);
+}
+
+static void produce_burst(IN rd_kafka_topic_t *topic,
+                          IN spill_replay_t *replay,
+                          IN producer_burst_t *burst,
+                          IN size_t count) {
+    uint64_t now_us = metrics_now_us();
+
+    memset(burst->rkmessages, 0, count * sizeof(rd_kafka_message_t));
+    for (size_t i = 0; i < count; i++) {
+        metrics_record_since(METRIC_LATENCY_RECEIVE_TO_PRODUCE, burst->payloads[i]->ingress_us, now_us);
+        burst->rkmessages[i].payload = payload_data(burst->payloads[i]);
+        burst->rkmessages[i].len = burst->payloads[i]->len;
+        burst->rkmessages[i]._private = burst->payloads[i];
+    }
+
+    int enqueued = rd_kafka_produce_batch(topic, RD_KAFKA_PARTITION_UA, 0,
+                                          burst->rkmessages, (int)count);
+    if (enqueued == (int)count) {
+        return;
+    }
+
+    rd_kafka_resp_err_t err = RD_KAFKA_RESP_ERR_NO_ERROR;
+    for (size_t i = 0; i < count; i++) {
+        if (burst->rkmessages[i].err) {
+            err = burst->rkmessages[i].err;
+            if (!keep_for_retry(replay, burst->payloads[i], err)) {
+                metrics_add(METRIC_PRODUCER_DELIVERY_FAILURES, 1);
+            }
+            if (burst->payloads[i]->spilled) {
+                replay_settled(replay, err);
+            }
+            payload_release(burst->payloads[i]);
+        }
+    }
+    LOG_WARN("Failed to enqueue %zu messages for topic %s: %s",
+             count - (size_t)(enqueued > 0 ? enqueued : 0),
+             rd_kafka_topic_name(topic),
+             rd_kafka_err2str(err));
+}
+
+static bool should_spill(IN rd_kafka_t *rk, IN spill_log_t *spill) {
+    return spill && (spill_log_pending(spill) > 0 || rd_kafka_outq_len(rk) >= KAFKA_SPILL_MAX_IN_FLIGHT);
+}
+
+static void spill_burst(IN spill_log_t *spill, IN producer_burst_t *burst, IN size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        spill_payload(spill, burst->payloads[i]);
+        payload_release(burst->payloads[i]);
+    }
+}
+
+static void replay_spill(IN rd_kafka_t *rk,
+                         IN rd_kafka_topic_t *topic,
+                         IN spill_replay_t *replay,
+                         IN producer_burst_t *burst) {
+    int in_flight;
+
+    if (spill_log_in_flight(replay->log) > 0) {
+        return;
+    }
+    while (spill_log_pending(replay->log) > 0 && metrics_now_us() >= replay->resume_us &&
+           (in_flight = rd_kafka_outq_len(rk)) < KAFKA_SPILL_MAX_IN_FLIGHT) {
+        size_t room = (size_t)(KAFKA_SPILL_MAX_IN_FLIGHT - in_flight);
+        size_t count = spill_log_read(replay->log, burst->payloads, room < burst->capacity ? room : burst->capacity);
+        if (count == 0) {
+            break;
+        }
+        metrics_add(METRIC_SPILL_REPLAYED, count);
+        produce_burst(topic, replay, burst, count);
+        rd_kafka_poll(rk, 0);
+    }
+}
+
+static int replay_timeout(IN spill_replay_t *replay, IN int timeout_ms) {
+    uint64_t now_us = metrics_now_us();
+
+    if (!replay->log || spill_log_pending(replay->log) == 0 || replay->resume_us <= now_us) {
+        return timeout_ms;
+    }
+    int wait_ms = (int)((replay->resume_us - now_us + 999) / 1000);
+    return timeout_ms > 0 && timeout_ms < wait_ms ? timeout_ms : wait_ms;
+}
+
 static void *kafka_producer_thread(IN void *arg) {
     char errstr[ERROR_STR_LEN];
     rd_kafka_t *rk;
     rd_kafka_topic_t *topic;
+    rd_kafka_queue_t *main_queue = NULL;
+    producer_burst_t burst;
+    int kafka_fd;
     producer_thread_args_t *args = (producer_thread_args_t *)arg;
     const config_t *cfg = args->cfg;
     message_queue_t *queue = args->queue;
+    spill_replay_t *replay = &args->replay;
+    spill_log_t *spill = replay->log;
     volatile sig_atomic_t *running = args->running;
     rd_kafka_conf_t *conf = rd_kafka_conf_new();
 
-    if (configure_kafka(conf, cfg) != 0) {
+    if (configure_kafka(conf, cfg, replay) != 0) {
         rd_kafka_conf_destroy(conf);
         free(args);
         return NULL;
@@ -81,36 +324,51 @@ static void *kafka_producer_thread(IN void *arg) {
         return NULL;
     }
 
+    if (create_burst(cfg, &burst) != 0) {
+        LOG_ERROR("%s", "Failed to allocate Kafka producer burst buffers");
+        cleanup_producer(rk, topic, args);
+        return NULL;
+    }
+
+    kafka_fd = enable_kafka_wakeup(rk, &main_queue);
+    if (kafka_fd < 0) {
+        LOG_ERROR("%s", "Failed to create Kafka producer wakeup");
+        destroy_burst(&burst);
+        cleanup_producer(rk, topic, args);
+        return NULL;
+    }
+
     LOG_INFO("Kafka producer started for topic %s", cfg->kafka_producer_topic);
 
     while (*running) {
-        char *msg = NULL;
-        size_t msg_len = 0;
-
-        if (message_queue_try_pop(queue, &msg, &msg_len)) {
-            int rc = rd_kafka_produce(
-                topic,
-                RD_KAFKA_PARTITION_UA,
-                RD_KAFKA_MSG_F_COPY,
-                msg,
-                msg_len,
-                NULL,
-                0,
-                NULL);
-
-            if (rc != 0) {
-                LOG_WARN("Failed to enqueue message for topic %s: %s",
-                         cfg->kafka_producer_topic,
-                         rd_kafka_err2str(rd_kafka_last_error()));
-            }
+        size_t count;
 
-            free(msg);
+        message_queue_clear_wakeup(queue);
+        while ((count = message_queue_try_pop_batch(queue, burst.payloads, burst.capacity)) > 0) {
+            if (should_spill(rk, spill)) {
+                spill_burst(spill, &burst, count);
+            } else {
+                produce_burst(topic, replay, &burst, count);
+            }
+            rd_kafka_poll(rk, 0);
+        }
+        if (spill) {
+            replay_spill(rk, topic, replay, &burst);
         }
 
-        rd_kafka_poll(rk, cfg->kafka_poll_timeout_ms);
+        rd_kafka_poll(rk, 0);
+        wait_for_work(queue, kafka_fd, replay_timeout(replay, cfg->kafka_poll_timeout_ms));
     }
 
     LOG_INFO("%s", "Shutting down Kafka producer");
+    if (spill) {
+        size_t count;
+        while ((count = message_queue_try_pop_batch(queue, burst.payloads, burst.capacity)) > 0) {
+            spill_burst(spill, &burst, count);
+        }
+    }
+    disable_kafka_wakeup(main_queue, kafka_fd);
+    destroy_burst(&burst);
     cleanup_producer(rk, topic, args);
     return NULL;
 }
@@ -118,6 +376,7 @@ static void *kafka_producer_thread(IN void *arg) {
 int kafka_producer_start(IN kafka_producer_t *producer,
                          IN const config_t *cfg,
                          IN message_queue_t *queue,
+                         IN spill_log_t *spill,
                          IN volatile sig_atomic_t *running_flag) {
     if (!producer || !cfg || !queue || !running_flag) {
         return -1;
@@ -133,6 +392,7 @@ int kafka_producer_start(IN kafka_producer_t *producer,
     }
     args->cfg = cfg;
     args->queue = queue;
+    args->replay.log = spill;
     args->running = running_flag;
 
     if (pthread_create(&producer->thread, NULL, kafka_producer_thread, args) != 0) {
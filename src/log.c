@@ -0,0 +1,335 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../inc/log.h"
+
+typedef struct {
+    char data[LOG_RING_SLOTS * LOG_LINE_MAX];
+    size_t len;
+} log_output_t;
+
+typedef struct {
+    time_t second;
+    char text[LOG_TIMESTAMP_LEN];
+} log_clock_t;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static log_ring_t *rings = NULL;
+static pthread_key_t ring_key;
+static pthread_t writer;
+static atomic_bool active = false;
+static atomic_bool writer_running = false;
+static atomic_bool wakeup_pending = false;
+static int wakeup_fd = -1;
+static atomic_size_t dropped_lines = 0;
+static log_output_t outputs[LOG_STDERR + 1];
+static _Atomic(log_site_t *) suppressed_sites = NULL;
+
+static _Thread_local log_ring_t *thread_ring = NULL;
+static _Thread_local bool thread_retired = false;
+static _Thread_local log_clock_t thread_clock = {0};
+
+static void flush_suppressed(log_ring_t *ring);
+
+static void retire_ring(void *ptr) {
+    log_ring_t *ring = (log_ring_t *)ptr;
+
+    flush_suppressed(atomic_load_explicit(&active, memory_order_acquire) ? ring : NULL);
+    thread_ring = NULL;
+    thread_retired = true;
+    atomic_store_explicit(&ring->retired, true, memory_order_release);
+}
+
+static log_ring_t *get_ring(void) {
+    if (thread_ring || thread_retired) {
+        return thread_ring;
+    }
+    log_ring_t *ring = calloc(1, sizeof(log_ring_t));
+    if (!ring) {
+        return NULL;
+    }
+    pthread_mutex_lock(&rings_lock);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&rings_lock);
+    pthread_setspecific(ring_key, ring);
+    thread_ring = ring;
+    return ring;
+}
+
+static void wake_writer(void) {
+    uint64_t one = 1;
+
+    if (!atomic_exchange_explicit(&wakeup_pending, true, memory_order_acq_rel)) {
+        if (write(wakeup_fd, &one, sizeof(one)) < 0) {
+            /* EAGAIN only means the counter is already saturated */
+        }
+    }
+}
+
+static const char *cached_timestamp(time_t *second) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    if (ts.tv_sec != thread_clock.second || !thread_clock.text[0]) {
+        struct tm tm_info;
+        localtime_r(&ts.tv_sec, &tm_info);
+        strftime(thread_clock.text, sizeof(thread_clock.text), "%Y-%m-%d %H:%M:%S", &tm_info);
+        thread_clock.second = ts.tv_sec;
+    }
+    *second = ts.tv_sec;
+    return thread_clock.text;
+}
+
+static void list_site(log_site_t *site, log_stream_t stream, const char *fmt) {
+    if (atomic_load_explicit(&site->listed, memory_order_relaxed) ||
+        atomic_exchange_explicit(&site->listed, true, memory_order_relaxed)) {
+        return;
+    }
+    site->stream = stream;
+    site->fmt = fmt;
+    site->next = atomic_load_explicit(&suppressed_sites, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&suppressed_sites, &site->next, site,
+                                                  memory_order_release, memory_order_relaxed)) {
+    }
+}
+
+static bool admit(log_site_t *site, long long second, unsigned *suppressed) {
+    long long window = atomic_load_explicit(&site->window, memory_order_relaxed);
+
+    *suppressed = 0;
+    if (window != second &&
+        atomic_compare_exchange_strong_explicit(&site->window, &window, second,
+                                                memory_order_relaxed, memory_order_relaxed)) {
+        atomic_store_explicit(&site->count, 0, memory_order_relaxed);
+        *suppressed = atomic_exchange_explicit(&site->suppressed, 0, memory_order_relaxed);
+    }
+    if (atomic_fetch_add_explicit(&site->count, 1, memory_order_relaxed) < LOG_RATE_LIMIT) {
+        return true;
+    }
+    atomic_fetch_add_explicit(&site->suppressed, 1, memory_order_relaxed);
+    return false;
+}
+
+static size_t format_line(char *buf, const char *timestamp, unsigned suppressed,
+                          const char *fmt, va_list args) {
+    size_t cap = LOG_LINE_MAX - 1;
+    int n = snprintf(buf, cap, "[%s] ", timestamp);
+    size_t len = n > 0 ? (size_t)n : 0;
+
+    n = vsnprintf(buf + len, cap - len, fmt, args);
+    len += n > 0 ? (size_t)n : 0;
+    if (len > cap - 1) {
+        len = cap - 1;
+    }
+    if (suppressed > 0) {
+        n = snprintf(buf + len, cap - len, " (%u similar messages suppressed)", suppressed);
+        len += n > 0 ? (size_t)n : 0;
+        if (len > cap - 1) {
+            len = cap - 1;
+        }
+    }
+    buf[len++] = '\n';
+    return len;
+}
+
+static void write_fd(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+}
+
+static log_record_t *reserve_record(log_ring_t *ring) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if (head - tail >= LOG_RING_SLOTS) {
+        atomic_fetch_add_explicit(&dropped_lines, 1, memory_order_relaxed);
+        wake_writer();
+        return NULL;
+    }
+    return &ring->records[head % LOG_RING_SLOTS];
+}
+
+static void commit_record(log_ring_t *ring) {
+    atomic_fetch_add_explicit(&ring->head, 1, memory_order_release);
+    wake_writer();
+}
+
+static void flush_suppressed(log_ring_t *ring) {
+    time_t second;
+    const char *timestamp = cached_timestamp(&second);
+
+    for (log_site_t *site = atomic_load_explicit(&suppressed_sites, memory_order_acquire); site; site = site->next) {
+        unsigned suppressed = atomic_exchange_explicit(&site->suppressed, 0, memory_order_relaxed);
+        if (suppressed == 0) {
+            continue;
+        }
+        char line[LOG_LINE_MAX];
+        log_record_t *record = ring ? reserve_record(ring) : NULL;
+        char *text = record ? record->text : line;
+        int n = snprintf(text, LOG_LINE_MAX, "[%s] %s (%u similar messages suppressed)\n",
+                         timestamp, site->fmt, suppressed);
+        size_t len = n < 0 ? 0 : (size_t)n < LOG_LINE_MAX ? (size_t)n : LOG_LINE_MAX - 1;
+        if (len > 0) {
+            text[len - 1] = '\n';
+        }
+        if (record) {
+            record->len = (uint16_t)len;
+            record->stream = site->stream;
+            commit_record(ring);
+        } else {
+            write_fd((int)site->stream, line, len);
+        }
+    }
+}
+
+void log_write(log_site_t *site, log_stream_t stream, const char *fmt, ...) {
+    time_t second;
+    unsigned suppressed;
+    va_list args;
+    const char *timestamp = cached_timestamp(&second);
+
+    if (!admit(site, (long long)second, &suppressed)) {
+        list_site(site, stream, fmt);
+        return;
+    }
+
+    log_ring_t *ring = atomic_load_explicit(&active, memory_order_acquire) ? get_ring() : NULL;
+    if (!ring) {
+        char line[LOG_LINE_MAX];
+        va_start(args, fmt);
+        size_t len = format_line(line, timestamp, suppressed, fmt, args);
+        va_end(args);
+        write_fd((int)stream, line, len);
+        return;
+    }
+
+    log_record_t *record = reserve_record(ring);
+    if (!record) {
+        atomic_fetch_add_explicit(&site->suppressed, suppressed, memory_order_relaxed);
+        return;
+    }
+    va_start(args, fmt);
+    record->len = (uint16_t)format_line(record->text, timestamp, suppressed, fmt, args);
+    va_end(args);
+    record->stream = stream;
+    commit_record(ring);
+}
+
+static void flush_output(log_stream_t stream) {
+    log_output_t *out = &outputs[stream];
+    write_fd((int)stream, out->data, out->len);
+    out->len = 0;
+}
+
+static void append_output(const log_record_t *record) {
+    log_output_t *out = &outputs[record->stream];
+    if (out->len + record->len > sizeof(out->data)) {
+        flush_output(record->stream);
+    }
+    memcpy(out->data + out->len, record->text, record->len);
+    out->len += record->len;
+}
+
+static bool drain_ring(log_ring_t *ring) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    for (size_t i = tail; i != head; i++) {
+        append_output(&ring->records[i % LOG_RING_SLOTS]);
+    }
+    atomic_store_explicit(&ring->tail, head, memory_order_release);
+    return head != tail;
+}
+
+static bool drain_rings(void) {
+    bool drained = false;
+
+    pthread_mutex_lock(&rings_lock);
+    for (log_ring_t **link = &rings; *link;) {
+        log_ring_t *ring = *link;
+        bool retired = atomic_load_explicit(&ring->retired, memory_order_acquire);
+        drained |= drain_ring(ring);
+        if (retired) {
+            *link = ring->next;
+            free(ring);
+        } else {
+            link = &ring->next;
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+
+    size_t dropped = atomic_exchange_explicit(&dropped_lines, 0, memory_order_relaxed);
+    if (dropped > 0) {
+        time_t second;
+        char line[LOG_LINE_MAX];
+        int n = snprintf(line, sizeof(line), "[%s] WARN: Logger dropped %zu lines; buffers full\n",
+                         cached_timestamp(&second), dropped);
+        write_fd(LOG_STDERR, line, (size_t)n);
+    }
+    flush_output(LOG_STDOUT);
+    flush_output(LOG_STDERR);
+    return drained;
+}
+
+static void *writer_thread(void *arg) {
+    (void)arg;
+    uint64_t count;
+
+    while (atomic_load_explicit(&writer_running, memory_order_acquire)) {
+        atomic_exchange_explicit(&wakeup_pending, false, memory_order_acq_rel);
+        drain_rings();
+        if (read(wakeup_fd, &count, sizeof(count)) < 0 && errno != EINTR) {
+            break;
+        }
+    }
+    drain_rings();
+    flush_suppressed(NULL);
+    return NULL;
+}
+
+int log_init(void) {
+    wakeup_fd = eventfd(0, EFD_CLOEXEC);
+    if (wakeup_fd < 0) {
+        return -1;
+    }
+    if (pthread_key_create(&ring_key, retire_ring) != 0) {
+        close(wakeup_fd);
+        return -1;
+    }
+    atomic_store(&writer_running, true);
+    if (pthread_create(&writer, NULL, writer_thread, NULL) != 0) {
+        atomic_store(&writer_running, false);
+        pthread_key_delete(ring_key);
+        close(wakeup_fd);
+        return -1;
+    }
+    atomic_store_explicit(&active, true, memory_order_release);
+    return 0;
+}
+
+void log_shutdown(void) {
+    if (!atomic_exchange(&active, false)) {
+        return;
+    }
+    atomic_store_explicit(&writer_running, false, memory_order_release);
+    atomic_store(&wakeup_pending, false);
+    wake_writer();
+    pthread_join(writer, NULL);
+    close(wakeup_fd);
+}
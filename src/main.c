@@ -1,3 +1,4 @@
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -5,7 +6,10 @@
 #include "../inc/env.h"
 #include "../inc/kafka_consumer.h"
 #include "../inc/kafka_producer.h"
+#include "../inc/log.h"
 #include "../inc/message_queue.h"
+#include "../inc/metrics.h"
+#include "../inc/spill_log.h"
 #include "../inc/websocket_server.h"
 #include "../inc/C/errors.h"
 #include "../inc/C/arguments.h"
@@ -20,25 +24,51 @@ static void handle_signal(IN int sig) {
 }
 
 int main(EMPTY) {
+    sigset_t signals;
     kafka_consumer_t consumer;
     kafka_producer_t producer;
     websocket_server_t *server;
+    spill_log_t *spill = NULL;
     int entry_count = GET_ARRAY_LENGTH(entries);
     int struct_size = sizeof(config_t);
-    config_t *config = load_config(entries, entry_count, struct_size);
-    message_queue_t *consumer_queue = message_queue_create((size_t)config->message_queue_capacity);
-    message_queue_t *producer_queue = message_queue_create((size_t)config->message_queue_capacity);
+    config_t *config;
+
+    config = load_config(entries, entry_count, struct_size);
+    message_queue_t *consumer_queue = message_queue_create((size_t)config->message_queue_capacity,
+                                                           config->kafka_consumer_workers > 1 ? MESSAGE_QUEUE_MPSC
+                                                                                              : MESSAGE_QUEUE_SPSC);
+    message_queue_t *producer_queue = message_queue_create((size_t)config->message_queue_capacity, MESSAGE_QUEUE_MPSC);
     signal(SIGINT, handle_signal);
     signal(SIGTERM, handle_signal);
- 
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    if (log_init() == 0) {
+        atexit(log_shutdown);
+    }
+
     if (!consumer_queue || !producer_queue) {
         if (consumer_queue) message_queue_destroy(consumer_queue);
         if (producer_queue) message_queue_destroy(producer_queue);
         free_config(config, entries, entry_count);
         ERROR_EXIT("Failed to create message queues");
     }
+    metrics_register_queue("consumer", consumer_queue);
+    metrics_register_queue("producer", producer_queue);
+    if (config->kafka_spill_dir && config->kafka_spill_dir[0]) {
+        size_t segment_mb = config->kafka_spill_segment_mb > 0 ? (size_t)config->kafka_spill_segment_mb
+                                                               : SPILL_LOG_DEFAULT_SEGMENT_MB;
+        size_t max_mb = config->kafka_spill_max_mb > 0 ? (size_t)config->kafka_spill_max_mb
+                                                       : SPILL_LOG_DEFAULT_MAX_MB;
+        spill = spill_log_open(config->kafka_spill_dir, segment_mb * SPILL_LOG_MB, max_mb * SPILL_LOG_MB);
+        if (!spill) {
+            LOG_WARN("Spill log disabled; failed to open %s", config->kafka_spill_dir);
+        }
+    }
     
-    if (kafka_producer_start(&producer, config, producer_queue, &running) != 0) {
+    if (kafka_producer_start(&producer, config, producer_queue, spill, &running) != 0) {
+        spill_log_close(spill);
         message_queue_destroy(consumer_queue);
         message_queue_destroy(producer_queue);
         free_config(config, entries, entry_count);
@@ -47,18 +77,21 @@ int main(EMPTY) {
     
     if (kafka_consumer_start(&consumer, config, consumer_queue, &running) != 0) {
         kafka_producer_stop(&producer);
+        spill_log_close(spill);
         message_queue_destroy(consumer_queue);
         message_queue_destroy(producer_queue);
         free_config(config, entries, entry_count);
         ERROR_EXIT("Failed to start Kafka consumer");
     }
     
-    server = websocket_server_create(config, consumer_queue, producer_queue, &running);
+    server = websocket_server_create(config, consumer_queue, producer_queue, spill, &running);
+    pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
 
     if (!server) {
         running = 0;
         kafka_consumer_stop(&consumer);
         kafka_producer_stop(&producer);
+        spill_log_close(spill);
         message_queue_destroy(consumer_queue);
         message_queue_destroy(producer_queue);
         free_config(config, entries, entry_count);
@@ -72,6 +105,7 @@ int main(EMPTY) {
     kafka_consumer_stop(&consumer);
     kafka_producer_stop(&producer);
     websocket_server_destroy(server);
+    spill_log_close(spill);
     message_queue_destroy(consumer_queue);
     message_queue_destroy(producer_queue);
     free_config(config, entries, entry_count);
@@ -1,15 +1,209 @@
+
+#include <sched.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "../inc/message_queue.h"
 #include "../inc/log.h"
 
-message_queue_t *message_queue_create(IN size_t capacity) {
-    message_queue_t *queue = calloc(1, sizeof(message_queue_t));
+static size_t ring_size_for(IN size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    return size;
+}
+
+static void backoff(IN unsigned int *spins) {
+    if (*spins < MESSAGE_QUEUE_SPIN_LIMIT) {
+        (*spins)++;
+        sched_yield();
+        return;
+    }
+    struct timespec ts = {0, MESSAGE_QUEUE_BACKOFF_NS};
+    nanosleep(&ts, NULL);
+}
+
+static void wake_consumer(IN message_queue_t *queue) {
+    uint64_t one = 1;
+
+    if (queue->notify) {
+        queue->notify(queue->notify_ctx);
+        return;
+    }
+    if (write(queue->event_fd, &one, sizeof(one)) < 0) {
+        /* EAGAIN only means the counter is already saturated */
+    }
+}
+
+static void signal_consumer(IN message_queue_t *queue) {
+    if (!atomic_exchange_explicit(&queue->wakeup_pending, true, memory_order_acq_rel)) {
+        wake_consumer(queue);
+    }
+}
+
+static bool spsc_try_push(IN message_queue_t *queue, IN payload_t *payload) {
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    if (head - queue->tail_cache > queue->mask) {
+        queue->tail_cache = atomic_load_explicit(&queue->tail, memory_order_acquire);
+        if (head - queue->tail_cache > queue->mask) {
+            return false;
+        }
+    }
+    queue->slots[head & queue->mask].payload = payload;
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return true;
+}
+
+static size_t spsc_try_push_bulk(IN message_queue_t *queue,
+                                 IN payload_t **payloads,
+                                 IN size_t count) {
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    size_t free_slots = queue->mask + 1 - (head - queue->tail_cache);
+    if (free_slots < count) {
+        queue->tail_cache = atomic_load_explicit(&queue->tail, memory_order_acquire);
+        free_slots = queue->mask + 1 - (head - queue->tail_cache);
+    }
+    size_t n = count < free_slots ? count : free_slots;
+    for (size_t i = 0; i < n; i++) {
+        queue->slots[(head + i) & queue->mask].payload = payloads[i];
+    }
+    if (n > 0) {
+        atomic_store_explicit(&queue->head, head + n, memory_order_release);
+    }
+    return n;
+}
+
+static bool spsc_try_pop(IN message_queue_t *queue, OUT payload_t **payload) {
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    if (tail == queue->head_cache) {
+        queue->head_cache = atomic_load_explicit(&queue->head, memory_order_acquire);
+        if (tail == queue->head_cache) {
+            return false;
+        }
+    }
+    *payload = queue->slots[tail & queue->mask].payload;
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+static bool mpsc_try_push(IN message_queue_t *queue, IN payload_t *payload) {
+    message_slot_t *slot;
+    size_t pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+
+    for (;;) {
+        slot = &queue->slots[pos & queue->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        ptrdiff_t diff = (ptrdiff_t)seq - (ptrdiff_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->head, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+        }
+    }
+
+    slot->payload = payload;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    return true;
+}
+
+static bool mpsc_try_pop(IN message_queue_t *queue, OUT payload_t **payload) {
+    size_t pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    message_slot_t *slot = &queue->slots[pos & queue->mask];
+    size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+    if ((ptrdiff_t)seq - (ptrdiff_t)(pos + 1) < 0) {
+        return false;
+    }
+    *payload = slot->payload;
+    atomic_store_explicit(&slot->seq, pos + queue->mask + 1, memory_order_release);
+    atomic_store_explicit(&queue->tail, pos + 1, memory_order_release);
+    return true;
+}
+
+static size_t locked_push_batch(IN message_queue_t *queue,
+                                IN payload_t **payloads,
+                                IN size_t count) {
+    size_t pushed = 0;
+
+    pthread_mutex_lock(&queue->mutex);
+    while (pushed < count && !atomic_load_explicit(&queue->closed, memory_order_relaxed)) {
+        size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+        if (head - atomic_load_explicit(&queue->tail, memory_order_relaxed) >= queue->capacity) {
+            if (pushed > 0) {
+                signal_consumer(queue);
+            }
+            pthread_cond_wait(&queue->cond_nonfull, &queue->mutex);
+            continue;
+        }
+        queue->slots[head & queue->mask].payload = payloads[pushed++];
+        atomic_store_explicit(&queue->head, head + 1, memory_order_relaxed);
+    }
+    if (pushed > 0) {
+        pthread_cond_signal(&queue->cond_nonempty);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return pushed;
+}
+
+static bool locked_try_pop(IN message_queue_t *queue, OUT payload_t **payload) {
+    pthread_mutex_lock(&queue->mutex);
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    if (tail == atomic_load_explicit(&queue->head, memory_order_relaxed)) {
+        pthread_mutex_unlock(&queue->mutex);
+        return false;
+    }
+    *payload = queue->slots[tail & queue->mask].payload;
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_relaxed);
+    pthread_cond_signal(&queue->cond_nonfull);
+    pthread_mutex_unlock(&queue->mutex);
+    return true;
+}
+
+message_queue_t *message_queue_create(IN size_t capacity, IN message_queue_mode_t mode) {
+    if (capacity == 0) {
+        LOG_ERROR("%s", "Message queue capacity must be greater than zero");
+        return NULL;
+    }
+    message_queue_t *queue = aligned_alloc(MESSAGE_QUEUE_CACHE_LINE, sizeof(message_queue_t));
     if (!queue) {
         return NULL;
     }
-    queue->capacity = capacity;
+    memset(queue, 0, sizeof(*queue));
+    queue->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (queue->event_fd < 0) {
+        LOG_ERROR("%s", "Failed to create message queue eventfd");
+        free(queue);
+        return NULL;
+    }
+
+    size_t ring_size = ring_size_for(capacity);
+    queue->slots = calloc(ring_size, sizeof(message_slot_t));
+    if (!queue->slots) {
+        close(queue->event_fd);
+        free(queue);
+        return NULL;
+    }
+    for (size_t i = 0; i < ring_size; i++) {
+        atomic_init(&queue->slots[i].seq, i);
+    }
+    queue->mode = mode;
+    queue->mask = ring_size - 1;
+    queue->capacity = mode == MESSAGE_QUEUE_LOCKED ? capacity : ring_size;
+    atomic_init(&queue->closed, false);
+    atomic_init(&queue->wakeup_pending, false);
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
     pthread_mutex_init(&queue->mutex, NULL);
     pthread_cond_init(&queue->cond_nonempty, NULL);
     pthread_cond_init(&queue->cond_nonfull, NULL);
@@ -17,92 +211,146 @@ message_queue_t *message_queue_create(IN size_t capacity) {
 }
 
 void message_queue_destroy(IN message_queue_t *queue) {
+    payload_t *payload;
+
     if (!queue) {
         return;
     }
     message_queue_close(queue);
-    pthread_mutex_lock(&queue->mutex);
-    message_node_t *next;
-    message_node_t *node = queue->head;
-    while (node) {
-        next = node->next;
-        free(node->data);
-        free(node);
-        node = next;
+    while (message_queue_try_pop(queue, &payload)) {
+        payload_release(payload);
     }
-    pthread_mutex_unlock(&queue->mutex);
     pthread_cond_destroy(&queue->cond_nonempty);
     pthread_cond_destroy(&queue->cond_nonfull);
     pthread_mutex_destroy(&queue->mutex);
+    close(queue->event_fd);
+    free(queue->slots);
     free(queue);
 }
 
-bool message_queue_push(IN message_queue_t *queue, IN const char *data, IN size_t len) {
-    if (!queue || !data || len == 0) {
-        return false;
-    }
+size_t message_queue_push_batch(IN message_queue_t *queue, IN payload_t **payloads, IN size_t count) {
+    size_t pushed = 0;
+    unsigned int spins = 0;
 
-    pthread_mutex_lock(&queue->mutex);
-    while (!queue->closed && queue->size >= queue->capacity) {
-        pthread_cond_wait(&queue->cond_nonfull, &queue->mutex);
+    if (!queue || !payloads || count == 0) {
+        return 0;
     }
-    if (queue->closed) {
-        pthread_mutex_unlock(&queue->mutex);
+    if (queue->mode == MESSAGE_QUEUE_LOCKED) {
+        pushed = locked_push_batch(queue, payloads, count);
+    } else {
+        while (pushed < count && !atomic_load_explicit(&queue->closed, memory_order_acquire)) {
+            size_t n;
+            if (queue->mode == MESSAGE_QUEUE_SPSC) {
+                n = spsc_try_push_bulk(queue, payloads + pushed, count - pushed);
+            } else {
+                n = mpsc_try_push(queue, payloads[pushed]) ? 1 : 0;
+            }
+            if (n == 0) {
+                if (pushed > 0) {
+                    signal_consumer(queue);
+                }
+                backoff(&spins);
+                continue;
+            }
+            pushed += n;
+        }
+    }
+    if (pushed > 0) {
+        signal_consumer(queue);
+    }
+    return pushed;
+}
+
+bool message_queue_try_push_payload(IN message_queue_t *queue, IN payload_t *payload) {
+    bool pushed = false;
+
+    if (!queue || !payload || atomic_load_explicit(&queue->closed, memory_order_acquire)) {
         return false;
     }
+    switch (queue->mode) {
+        case MESSAGE_QUEUE_SPSC:
+            pushed = spsc_try_push(queue, payload);
+            break;
+        case MESSAGE_QUEUE_MPSC:
+            pushed = mpsc_try_push(queue, payload);
+            break;
+        default: {
+            pthread_mutex_lock(&queue->mutex);
+            size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+            if (!atomic_load_explicit(&queue->closed, memory_order_relaxed) &&
+                head - atomic_load_explicit(&queue->tail, memory_order_relaxed) < queue->capacity) {
+                queue->slots[head & queue->mask].payload = payload;
+                atomic_store_explicit(&queue->head, head + 1, memory_order_relaxed);
+                pthread_cond_signal(&queue->cond_nonempty);
+                pushed = true;
+            }
+            pthread_mutex_unlock(&queue->mutex);
+            break;
+        }
+    }
+    if (pushed) {
+        signal_consumer(queue);
+    }
+    return pushed;
+}
 
-    message_node_t *node = calloc(1, sizeof(message_node_t));
-    if (!node) {
-        pthread_mutex_unlock(&queue->mutex);
+bool message_queue_push_payload(IN message_queue_t *queue, IN payload_t *payload) {
+    return message_queue_push_batch(queue, &payload, 1) == 1;
+}
+
+bool message_queue_push(IN message_queue_t *queue, IN const char *data, IN size_t len) {
+    if (!queue || !data || len == 0) {
         return false;
     }
-    node->data = malloc(len + 1);
-    if (!node->data) {
-        free(node);
-        pthread_mutex_unlock(&queue->mutex);
+    payload_t *payload = payload_create(data, len);
+    if (!payload) {
         return false;
     }
-    memcpy(node->data, data, len);
-    node->data[len] = '\0';
-    node->len = len;
-
-    if (!queue->tail) {
-        queue->head = queue->tail = node;
-    } else {
-        queue->tail->next = node;
-        queue->tail = node;
+    if (!message_queue_push_payload(queue, payload)) {
+        payload_release(payload);
+        return false;
     }
-    queue->size++;
-    pthread_cond_signal(&queue->cond_nonempty);
-    pthread_mutex_unlock(&queue->mutex);
     return true;
 }
 
-bool message_queue_try_pop(IN message_queue_t *queue, OUT char **data, OUT size_t *len) {
-    if (!queue || !data || !len) {
+bool message_queue_try_pop(IN message_queue_t *queue, OUT payload_t **payload) {
+    if (!queue || !payload) {
         return false;
     }
+    switch (queue->mode) {
+        case MESSAGE_QUEUE_SPSC:
+            return spsc_try_pop(queue, payload);
+        case MESSAGE_QUEUE_MPSC:
+            return mpsc_try_pop(queue, payload);
+        default:
+            return locked_try_pop(queue, payload);
+    }
+}
 
-    pthread_mutex_lock(&queue->mutex);
-    if (queue->size == 0) {
+size_t message_queue_try_pop_batch(IN message_queue_t *queue, OUT payload_t **payloads, IN size_t max) {
+    size_t popped = 0;
+
+    if (!queue || !payloads) {
+        return 0;
+    }
+    if (queue->mode == MESSAGE_QUEUE_LOCKED) {
+        pthread_mutex_lock(&queue->mutex);
+        size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+        while (popped < max && tail != head) {
+            payloads[popped++] = queue->slots[tail++ & queue->mask].payload;
+        }
+        atomic_store_explicit(&queue->tail, tail, memory_order_relaxed);
+        if (popped > 0) {
+            pthread_cond_broadcast(&queue->cond_nonfull);
+        }
         pthread_mutex_unlock(&queue->mutex);
-        return false;
+        return popped;
     }
-
-    message_node_t *node = queue->head;
-    queue->head = node->next;
-    if (!queue->head) {
-        queue->tail = NULL;
+    while (popped < max && message_queue_try_pop(queue, &payloads[popped])) {
+        popped++;
     }
-
-    queue->size--;
-    pthread_cond_signal(&queue->cond_nonfull);
-    pthread_mutex_unlock(&queue->mutex);
-
-    *data = node->data;
-    *len = node->len;
-    free(node);
-    return true;
+    return popped;
 }
 
 void message_queue_close(IN message_queue_t *queue) {
@@ -110,9 +358,46 @@ void message_queue_close(IN message_queue_t *queue) {
         return;
     }
     pthread_mutex_lock(&queue->mutex);
-    queue->closed = true;
+    atomic_store_explicit(&queue->closed, true, memory_order_release);
     pthread_cond_broadcast(&queue->cond_nonempty);
     pthread_cond_broadcast(&queue->cond_nonfull);
     pthread_mutex_unlock(&queue->mutex);
+    atomic_store_explicit(&queue->wakeup_pending, true, memory_order_release);
+    wake_consumer(queue);
+}
+
+size_t message_queue_size(IN message_queue_t *queue) {
+    if (!queue) {
+        return 0;
+    }
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    return head - tail;
+}
+
+int message_queue_event_fd(IN message_queue_t *queue) {
+    return queue ? queue->event_fd : -1;
 }
 
+void message_queue_set_notify(IN message_queue_t *queue,
+                              IN message_queue_notify_fn notify,
+                              IN void *ctx) {
+    if (!queue) {
+        return;
+    }
+    queue->notify = notify;
+    queue->notify_ctx = ctx;
+    atomic_store_explicit(&queue->wakeup_pending, true, memory_order_release);
+}
+
+void message_queue_clear_wakeup(IN message_queue_t *queue) {
+    uint64_t count;
+
+    if (!queue) {
+        return;
+    }
+    if (read(queue->event_fd, &count, sizeof(count)) < 0) {
+        /* EAGAIN: nothing was signalled through the eventfd */
+    }
+    atomic_exchange_explicit(&queue->wakeup_pending, false, memory_order_acq_rel);
+}
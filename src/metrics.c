@@ -0,0 +1,381 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../inc/metrics.h"
+#include "../inc/payload_pool.h"
+
+typedef struct {
+    const char *name;
+    const char *type;
+    const char *help;
+} metric_desc_t;
+
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+    bool failed;
+} metrics_text_t;
+
+static const metric_desc_t counter_descs[METRIC_COUNTER_COUNT] = {
+    [METRIC_KAFKA_CONSUMED] = {"lootopia_kafka_consumed_messages_total", "counter", "Messages read from Kafka"},
+    [METRIC_KAFKA_CONSUMED_BYTES] = {"lootopia_kafka_consumed_bytes_total", "counter", "Payload bytes read from Kafka"},
+    [METRIC_CONSUMER_QUEUE_DROPS] = {"lootopia_consumer_queue_drops_total", "counter", "Kafka messages dropped before the consumer queue"},
+    [METRIC_PRODUCER_QUEUE_DROPS] = {"lootopia_producer_queue_drops_total", "counter", "Client messages dropped before the producer queue"},
+    [METRIC_SHARD_INBOX_DROPS] = {"lootopia_shard_inbox_drops_total", "counter", "Messages dropped because a service thread inbox was full"},
+    [METRIC_BROADCAST_QUEUE_DROPS] = {"lootopia_broadcast_queue_drops_total", "counter", "Client messages dropped before the dispatcher's broadcast queue"},
+    [METRIC_BROADCASTS] = {"lootopia_broadcasts_total", "counter", "Messages fanned out by a service thread"},
+    [METRIC_FANOUT_DELIVERIES] = {"lootopia_fanout_deliveries_total", "counter", "Messages queued to sessions"},
+    [METRIC_SESSION_DROPS] = {"lootopia_session_drops_total", "counter", "Messages dropped by the slow-consumer policy"},
+    [METRIC_SESSION_DROPPED_BYTES] = {"lootopia_session_dropped_bytes_total", "counter", "Bytes dropped by the slow-consumer policy"},
+    [METRIC_SESSION_CONFLATED] = {"lootopia_session_conflated_total", "counter", "Queued messages replaced by a newer one with the same key"},
+    [METRIC_FRAMES_WRITTEN] = {"lootopia_ws_frames_written_total", "counter", "WebSocket frames written"},
+    [METRIC_BYTES_WRITTEN] = {"lootopia_ws_bytes_written_total", "counter", "WebSocket payload bytes written"},
+    [METRIC_PRODUCER_DELIVERED] = {"lootopia_kafka_delivered_total", "counter", "Messages acknowledged by Kafka"},
+    [METRIC_PRODUCER_DELIVERY_FAILURES] = {"lootopia_kafka_delivery_failures_total", "counter", "Messages Kafka failed to deliver"},
+    [METRIC_PRODUCER_LATENCY_US] = {"lootopia_kafka_delivery_latency_microseconds_total", "counter", "Sum of produce-to-ack latency"},
+    [METRIC_CONSUMER_PAUSES] = {"lootopia_kafka_consumer_pauses_total", "counter", "Times the consumer paused its partitions"},
+    [METRIC_SPILLED] = {"lootopia_spill_appended_total", "counter", "Messages written to the disk spill log"},
+    [METRIC_SPILL_REPLAYED] = {"lootopia_spill_replayed_total", "counter", "Messages replayed from the disk spill log"},
+    [METRIC_SPILL_DROPS] = {"lootopia_spill_drops_total", "counter", "Messages lost because the spill log was full"},
+    [METRIC_REPLAYED] = {"lootopia_ws_replayed_total", "counter", "Messages replayed to resuming sessions"},
+    [METRIC_REPLAY_GAPS] = {"lootopia_ws_replay_gaps_total", "counter", "Resumes that needed messages already evicted from the replay ring"},
+    [METRIC_REPLAY_RESETS] = {"lootopia_ws_replay_resets_total", "counter", "Resumes refused because the epoch did not match this process"},
+    [METRIC_OVERSIZED_MESSAGES] = {"lootopia_ws_oversized_messages_total", "counter", "Client messages rejected for exceeding WS_MAX_MESSAGE_BYTES"},
+    [METRIC_PAYLOAD_POOL_HITS] = {"lootopia_payload_pool_hits_total", "counter", "Payload buffers reused from the pool"},
+    [METRIC_PAYLOAD_POOL_MISSES] = {"lootopia_payload_pool_misses_total", "counter", "Payload buffers allocated with malloc"},
+    [METRIC_DEFLATE_FRAMES] = {"lootopia_ws_deflate_frames_total", "counter", "Broadcasts compressed once into a shared permessage-deflate frame"},
+    [METRIC_DEFLATE_IN_BYTES] = {"lootopia_ws_deflate_in_bytes_total", "counter", "Bytes fed to shared permessage-deflate compression"},
+    [METRIC_DEFLATE_OUT_BYTES] = {"lootopia_ws_deflate_out_bytes_total", "counter", "Bytes produced by shared permessage-deflate compression"},
+    [METRIC_DEFLATE_FALLBACKS] = {"lootopia_ws_deflate_fallbacks_total", "counter", "Sessions that negotiated permessage-deflate but compress per connection"},
+    [METRIC_FILTERED] = {"lootopia_ws_filtered_total", "counter", "Deliveries skipped because the session's filter did not match"},
+    [METRIC_OFFSETS_STORED] = {"lootopia_kafka_offsets_stored_total", "counter", "Partition offsets stored after their messages were broadcast"},
+    [METRIC_OFFSET_COMMITS] = {"lootopia_kafka_offset_commits_total", "counter", "Offset commits triggered by the broadcast commit mode"}
+};
+
+static const metric_desc_t gauge_descs[METRIC_GAUGE_COUNT] = {
+    [METRIC_SESSIONS] = {"lootopia_ws_sessions", "gauge", "Connected WebSocket sessions"},
+    [METRIC_CONSUMER_PAUSED] = {"lootopia_kafka_consumer_paused", "gauge", "1 while partitions are paused for backpressure"},
+    [METRIC_SESSIONS_RX_PAUSED] = {"lootopia_ws_sessions_rx_paused", "gauge", "Sessions not read from while the producer queue drains"}
+};
+
+static const metric_desc_t histogram_descs[METRIC_HISTOGRAM_COUNT] = {
+    [METRIC_LATENCY_CONSUMER_QUEUE] = {"consumer_queue", "summary", "Kafka ingress to dispatcher"},
+    [METRIC_LATENCY_INBOX] = {"inbox", "summary", "Dispatcher to service thread fanout"},
+    [METRIC_LATENCY_SESSION_QUEUE] = {"session_queue", "summary", "Session enqueue to lws_write"},
+    [METRIC_LATENCY_INGRESS_TO_SOCKET] = {"ingress_to_socket", "summary", "Kafka ingress to lws_write"},
+    [METRIC_LATENCY_KAFKA_TO_SOCKET] = {"kafka_to_socket", "summary", "Kafka message timestamp to lws_write"},
+    [METRIC_LATENCY_RECEIVE_TO_PRODUCE] = {"receive_to_produce", "summary", "WebSocket receive to rd_kafka_produce"},
+    [METRIC_LATENCY_PRODUCE_TO_ACK] = {"produce_to_ack", "summary", "rd_kafka_produce to delivery report"}
+};
+
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+static metrics_slot_t slots[METRICS_MAX_THREADS];
+static atomic_uint next_slot = 0;
+static _Thread_local metrics_slot_t *thread_slot = NULL;
+
+static atomic_int_fast64_t gauges[METRIC_GAUGE_COUNT];
+static pthread_mutex_t topics_lock = PTHREAD_MUTEX_INITIALIZER;
+static metrics_topic_t topics[METRICS_MAX_TOPICS];
+static atomic_int topic_count = 0;
+
+static pthread_mutex_t queues_lock = PTHREAD_MUTEX_INITIALIZER;
+static metrics_queue_t queues[METRICS_MAX_QUEUES];
+static size_t queue_count = 0;
+
+static metrics_slot_t *get_slot(void) {
+    if (!thread_slot) {
+        unsigned index = atomic_fetch_add_explicit(&next_slot, 1, memory_order_relaxed);
+        thread_slot = &slots[index % METRICS_MAX_THREADS];
+    }
+    return thread_slot;
+}
+
+static size_t bucket_index(IN uint64_t value) {
+    if (value < 2 * METRICS_HISTOGRAM_SUB_BUCKETS) {
+        return (size_t)value;
+    }
+    int exp = 63 - __builtin_clzll(value);
+    if (exp > METRICS_HISTOGRAM_MAX_EXP) {
+        return METRICS_HISTOGRAM_BUCKETS - 1;
+    }
+    return ((size_t)(exp - METRICS_HISTOGRAM_SUB_BITS) << METRICS_HISTOGRAM_SUB_BITS) +
+           (size_t)(value >> (exp - METRICS_HISTOGRAM_SUB_BITS));
+}
+
+static uint64_t bucket_upper_bound(IN size_t index) {
+    if (index < 2 * METRICS_HISTOGRAM_SUB_BUCKETS) {
+        return index;
+    }
+    int exp = (int)(index >> METRICS_HISTOGRAM_SUB_BITS) + METRICS_HISTOGRAM_SUB_BITS - 1;
+    uint64_t mantissa = (index & (METRICS_HISTOGRAM_SUB_BUCKETS - 1)) + METRICS_HISTOGRAM_SUB_BUCKETS;
+    return ((mantissa + 1) << (exp - METRICS_HISTOGRAM_SUB_BITS)) - 1;
+}
+
+void metrics_add(IN metric_counter_t counter, IN uint64_t value) {
+    atomic_fetch_add_explicit(&get_slot()->counters[counter], value, memory_order_relaxed);
+}
+
+void metrics_record(IN metric_histogram_t histogram, IN uint64_t value_us) {
+    metrics_slot_t *slot = get_slot();
+    atomic_fetch_add_explicit(&slot->histograms[histogram][bucket_index(value_us)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&slot->histogram_sums[histogram], value_us, memory_order_relaxed);
+}
+
+void metrics_record_since(IN metric_histogram_t histogram, IN uint64_t start_us, IN uint64_t now_us) {
+    if (start_us == 0) {
+        return;
+    }
+    metrics_record(histogram, now_us > start_us ? now_us - start_us : 0);
+}
+
+void metrics_gauge_add(IN metric_gauge_t gauge, IN int64_t delta) {
+    atomic_fetch_add_explicit(&gauges[gauge], delta, memory_order_relaxed);
+}
+
+int metrics_register_topic(IN const char *name) {
+    int index = -1;
+
+    pthread_mutex_lock(&topics_lock);
+    int count = atomic_load_explicit(&topic_count, memory_order_relaxed);
+    for (int i = 0; i < count; i++) {
+        if (strcmp(topics[i].name, name) == 0) {
+            index = i;
+            break;
+        }
+    }
+    if (index < 0 && count < METRICS_MAX_TOPICS) {
+        snprintf(topics[count].name, sizeof(topics[count].name), "%s", name);
+        index = count;
+        atomic_store_explicit(&topic_count, count + 1, memory_order_release);
+    }
+    pthread_mutex_unlock(&topics_lock);
+    return index;
+}
+
+void metrics_set_partition_lag(IN int topic, IN int32_t partition, IN int64_t lag) {
+    if (topic < 0 || topic >= METRICS_MAX_TOPICS || partition < 0 || partition >= METRICS_MAX_PARTITIONS) {
+        return;
+    }
+    metrics_topic_t *entry = &topics[topic];
+    atomic_store_explicit(&entry->lag[partition], lag > 0 ? lag : 0, memory_order_relaxed);
+
+    int count = atomic_load_explicit(&entry->partition_count, memory_order_relaxed);
+    while (partition >= count &&
+           !atomic_compare_exchange_weak_explicit(&entry->partition_count, &count, partition + 1,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+void metrics_register_queue(IN const char *name, IN message_queue_t *queue) {
+    pthread_mutex_lock(&queues_lock);
+    if (queue && queue_count < METRICS_MAX_QUEUES) {
+        snprintf(queues[queue_count].name, sizeof(queues[queue_count].name), "%s", name);
+        queues[queue_count].queue = queue;
+        queue_count++;
+    }
+    pthread_mutex_unlock(&queues_lock);
+}
+
+void metrics_unregister_queue(IN message_queue_t *queue) {
+    pthread_mutex_lock(&queues_lock);
+    for (size_t i = 0; i < queue_count; i++) {
+        if (queues[i].queue == queue) {
+            queues[i] = queues[--queue_count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&queues_lock);
+}
+
+static bool reserve(IN metrics_text_t *out, IN size_t extra) {
+    if (out->len + extra < out->cap) {
+        return true;
+    }
+    size_t cap = out->cap * 2;
+    while (out->len + extra >= cap) {
+        cap *= 2;
+    }
+    char *grown = realloc(out->buf, cap);
+    if (!grown) {
+        out->failed = true;
+        return false;
+    }
+    out->buf = grown;
+    out->cap = cap;
+    return true;
+}
+
+static void append(IN metrics_text_t *out, IN const char *fmt, ...) {
+    va_list args;
+
+    if (out->failed) {
+        return;
+    }
+    va_start(args, fmt);
+    int n = vsnprintf(out->buf + out->len, out->cap - out->len, fmt, args);
+    va_end(args);
+    if (n < 0) {
+        out->failed = true;
+        return;
+    }
+    if ((size_t)n >= out->cap - out->len) {
+        if (!reserve(out, (size_t)n)) {
+            return;
+        }
+        va_start(args, fmt);
+        vsnprintf(out->buf + out->len, out->cap - out->len, fmt, args);
+        va_end(args);
+    }
+    out->len += (size_t)n;
+}
+
+static void append_header(IN metrics_text_t *out, IN const metric_desc_t *desc) {
+    append(out, "# HELP %s %s\n# TYPE %s %s\n", desc->name, desc->help, desc->name, desc->type);
+}
+
+static uint64_t sum_counter(IN metric_counter_t counter) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < METRICS_MAX_THREADS; i++) {
+        total += atomic_load_explicit(&slots[i].counters[counter], memory_order_relaxed);
+    }
+    return total;
+}
+
+static void render_queues(IN metrics_text_t *out) {
+    append(out, "%s",
+           "# HELP lootopia_queue_size Messages waiting in a queue\n"
+           "# TYPE lootopia_queue_size gauge\n");
+    pthread_mutex_lock(&queues_lock);
+    for (size_t i = 0; i < queue_count; i++) {
+        append(out, "lootopia_queue_size{queue=\"%s\"} %zu\n",
+               queues[i].name, message_queue_size(queues[i].queue));
+    }
+    append(out, "%s",
+           "# HELP lootopia_queue_capacity Slots available in a queue\n"
+           "# TYPE lootopia_queue_capacity gauge\n");
+    for (size_t i = 0; i < queue_count; i++) {
+        append(out, "lootopia_queue_capacity{queue=\"%s\"} %zu\n",
+               queues[i].name, queues[i].queue->capacity);
+    }
+    pthread_mutex_unlock(&queues_lock);
+}
+
+static void render_pool(IN metrics_text_t *out) {
+    payload_pool_stats_t stats[PAYLOAD_POOL_CLASSES];
+
+    for (int i = 0; i < PAYLOAD_POOL_CLASSES; i++) {
+        payload_pool_stats(i, &stats[i]);
+    }
+    append(out, "%s",
+           "# HELP lootopia_payload_pool_bytes Bytes held by a payload size class, in use or cached\n"
+           "# TYPE lootopia_payload_pool_bytes gauge\n");
+    for (int i = 0; i < PAYLOAD_POOL_CLASSES; i++) {
+        append(out, "lootopia_payload_pool_bytes{class=\"%zu\"} %zu\n",
+               stats[i].bytes, (stats[i].allocated - stats[i].released) * stats[i].bytes);
+    }
+    append(out, "%s",
+           "# HELP lootopia_payload_pool_cached Buffers on a size class's shared free list\n"
+           "# TYPE lootopia_payload_pool_cached gauge\n");
+    for (int i = 0; i < PAYLOAD_POOL_CLASSES; i++) {
+        append(out, "lootopia_payload_pool_cached{class=\"%zu\"} %zu\n",
+               stats[i].bytes, stats[i].cached);
+    }
+}
+
+static void render_lag(IN metrics_text_t *out) {
+    int count = atomic_load_explicit(&topic_count, memory_order_acquire);
+
+    append(out, "%s",
+           "# HELP lootopia_kafka_consumer_lag Messages behind the partition high watermark\n"
+           "# TYPE lootopia_kafka_consumer_lag gauge\n");
+    for (int t = 0; t < count; t++) {
+        int partitions = atomic_load_explicit(&topics[t].partition_count, memory_order_relaxed);
+        for (int i = 0; i < partitions; i++) {
+            append(out, "lootopia_kafka_consumer_lag{topic=\"%s\",partition=\"%d\"} %lld\n",
+                   topics[t].name, i, (long long)atomic_load_explicit(&topics[t].lag[i], memory_order_relaxed));
+        }
+    }
+}
+
+static void render_histogram(IN metrics_text_t *out, IN metric_histogram_t histogram) {
+    uint64_t buckets[METRICS_HISTOGRAM_BUCKETS];
+    const char *stage = histogram_descs[histogram].name;
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    size_t max_index = 0;
+
+    memset(buckets, 0, sizeof(buckets));
+    for (size_t i = 0; i < METRICS_MAX_THREADS; i++) {
+        sum += atomic_load_explicit(&slots[i].histogram_sums[histogram], memory_order_relaxed);
+        for (size_t b = 0; b < METRICS_HISTOGRAM_BUCKETS; b++) {
+            buckets[b] += atomic_load_explicit(&slots[i].histograms[histogram][b], memory_order_relaxed);
+        }
+    }
+    for (size_t b = 0; b < METRICS_HISTOGRAM_BUCKETS; b++) {
+        count += buckets[b];
+        if (buckets[b] > 0) {
+            max_index = b;
+        }
+    }
+
+    for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+        uint64_t rank = (uint64_t)(quantiles[q] * (double)count);
+        uint64_t seen = 0;
+        size_t b = 0;
+        while (count > 0 && b < max_index && seen + buckets[b] <= rank) {
+            seen += buckets[b++];
+        }
+        append(out, "lootopia_latency_microseconds{stage=\"%s\",quantile=\"%g\"} %llu\n",
+               stage, quantiles[q], (unsigned long long)(count > 0 ? bucket_upper_bound(b) : 0));
+    }
+    append(out, "lootopia_latency_microseconds_max{stage=\"%s\"} %llu\n",
+           stage, (unsigned long long)(count > 0 ? bucket_upper_bound(max_index) : 0));
+    append(out, "lootopia_latency_microseconds_sum{stage=\"%s\"} %llu\n",
+           stage, (unsigned long long)sum);
+    append(out, "lootopia_latency_microseconds_count{stage=\"%s\"} %llu\n",
+           stage, (unsigned long long)count);
+}
+
+static void render_latency(IN metrics_text_t *out) {
+    append(out, "%s",
+           "# HELP lootopia_latency_microseconds Latency of each pipeline stage\n"
+           "# TYPE lootopia_latency_microseconds summary\n");
+    for (int i = 0; i < METRIC_HISTOGRAM_COUNT; i++) {
+        render_histogram(out, (metric_histogram_t)i);
+    }
+}
+
+char *metrics_render(IN size_t headroom, OUT size_t *len) {
+    metrics_text_t text = {malloc(headroom + METRICS_BUFFER_SIZE), headroom, headroom + METRICS_BUFFER_SIZE, false};
+    metrics_text_t *out = &text;
+
+    if (!text.buf) {
+        return NULL;
+    }
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++) {
+        append_header(out, &counter_descs[i]);
+        append(out, "%s %llu\n", counter_descs[i].name,
+               (unsigned long long)sum_counter((metric_counter_t)i));
+    }
+    for (int i = 0; i < METRIC_GAUGE_COUNT; i++) {
+        append_header(out, &gauge_descs[i]);
+        append(out, "%s %lld\n", gauge_descs[i].name,
+               (long long)atomic_load_explicit(&gauges[i], memory_order_relaxed));
+    }
+    render_queues(out);
+    render_pool(out);
+    render_lag(out);
+    render_latency(out);
+    if (text.failed) {
+        free(text.buf);
+        return NULL;
+    }
+    *len = text.len - headroom;
+    return text.buf;
+}
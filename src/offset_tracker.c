@@ -0,0 +1,110 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "../inc/offset_tracker.h"
+
+static uint64_t pack_done(IN uint64_t generation, IN uint64_t next) {
+    return (generation << OFFSET_TRACKER_OFFSET_BITS) | next;
+}
+
+int offset_tracker_init(OUT offset_tracker_t *tracker, IN const char **topics, IN size_t topic_count) {
+    size_t slot_count = topic_count * OFFSET_TRACKER_PARTITIONS;
+
+    memset(tracker, 0, sizeof(*tracker));
+    tracker->slots = calloc(slot_count, sizeof(offset_slot_t));
+    tracker->topics = calloc(topic_count, sizeof(const char *));
+    if (!tracker->slots || !tracker->topics) {
+        offset_tracker_destroy(tracker);
+        return -1;
+    }
+    memcpy(tracker->topics, topics, topic_count * sizeof(const char *));
+    tracker->topic_count = topic_count;
+    for (size_t i = 0; i < slot_count; i++) {
+        atomic_init(&tracker->slots[i].done, 0);
+        atomic_init(&tracker->slots[i].generation, 0);
+        tracker->slots[i].stored = OFFSET_TRACKER_NONE;
+    }
+    atomic_init(&tracker->high, 0);
+    atomic_init(&tracker->tracked, 0);
+    return 0;
+}
+
+void offset_tracker_destroy(IN offset_tracker_t *tracker) {
+    free(tracker->slots);
+    free(tracker->topics);
+    tracker->slots = NULL;
+    tracker->topics = NULL;
+}
+
+bool offset_tracker_track(IN offset_tracker_t *tracker, IN payload_t *payload,
+                          IN size_t topic, IN int32_t partition, IN int64_t offset) {
+    if (topic >= tracker->topic_count || partition < 0 || partition >= OFFSET_TRACKER_PARTITIONS) {
+        return false;
+    }
+    size_t index = topic * OFFSET_TRACKER_PARTITIONS + (size_t)partition;
+    size_t high = atomic_load_explicit(&tracker->high, memory_order_relaxed);
+    while (high <= index &&
+           !atomic_compare_exchange_weak_explicit(&tracker->high, &high, index + 1,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+    }
+    payload->commit_slot = &tracker->slots[index];
+    payload->commit_generation = atomic_load_explicit(&tracker->slots[index].generation, memory_order_acquire);
+    payload->offset = offset;
+    atomic_fetch_add_explicit(&tracker->tracked, 1, memory_order_relaxed);
+    return true;
+}
+
+void offset_tracker_reset(IN offset_tracker_t *tracker, IN size_t topic, IN int32_t partition) {
+    if (topic >= tracker->topic_count || partition < 0 || partition >= OFFSET_TRACKER_PARTITIONS) {
+        return;
+    }
+    offset_slot_t *slot = &tracker->slots[topic * OFFSET_TRACKER_PARTITIONS + (size_t)partition];
+    uint64_t generation = (atomic_load_explicit(&slot->generation, memory_order_relaxed) + 1) &
+                          OFFSET_TRACKER_GENERATION_MASK;
+    atomic_store_explicit(&slot->done, pack_done(generation, 0), memory_order_release);
+    atomic_store_explicit(&slot->generation, generation, memory_order_release);
+    slot->stored = OFFSET_TRACKER_NONE;
+}
+
+size_t offset_tracker_collect(IN offset_tracker_t *tracker, OUT rd_kafka_topic_partition_list_t *list) {
+    size_t high = atomic_load_explicit(&tracker->high, memory_order_relaxed);
+    size_t count = 0;
+
+    for (size_t i = 0; i < high; i++) {
+        offset_slot_t *slot = &tracker->slots[i];
+        int64_t done = (int64_t)(atomic_load_explicit(&slot->done, memory_order_acquire) & OFFSET_TRACKER_OFFSET_MASK);
+        if (done == 0 || done <= slot->stored) {
+            continue;
+        }
+        rd_kafka_topic_partition_t *tp = rd_kafka_topic_partition_list_add(
+            list, tracker->topics[i / OFFSET_TRACKER_PARTITIONS], (int32_t)(i % OFFSET_TRACKER_PARTITIONS));
+        if (!tp) {
+            break;
+        }
+        tp->offset = done;
+        slot->stored = done;
+        count++;
+    }
+    return count;
+}
+
+void offset_tracker_mark(IN payload_t *payload) {
+    if (payload->origin) {
+        payload = payload->origin;
+    }
+    offset_slot_t *slot = payload->commit_slot;
+
+    if (!slot || atomic_fetch_sub_explicit(&payload->pending_marks, 1, memory_order_acq_rel) != 1) {
+        return;
+    }
+    uint64_t next = (uint64_t)payload->offset + 1;
+    if (next > OFFSET_TRACKER_OFFSET_MASK) {
+        return;
+    }
+    uint64_t want = pack_done(payload->commit_generation, next);
+    uint64_t done = atomic_load_explicit(&slot->done, memory_order_relaxed);
+    while (done >> OFFSET_TRACKER_OFFSET_BITS == payload->commit_generation && done < want &&
+           !atomic_compare_exchange_weak_explicit(&slot->done, &done, want,
+                                                  memory_order_release, memory_order_relaxed)) {
+    }
+}
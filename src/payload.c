@@ -0,0 +1,99 @@
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../inc/metrics.h"
+#include "../inc/payload.h"
+#include "../inc/payload_pool.h"
+
+static uint32_t key_hash(IN const char *key, IN size_t len) {
+    uint32_t hash = PAYLOAD_HASH_SEED;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)key[i]) * PAYLOAD_HASH_PRIME;
+    }
+    return hash;
+}
+
+payload_t *payload_create(IN const char *data, IN size_t len) {
+    return payload_create_routed(data, len, NULL, 0, NULL, 0);
+}
+
+payload_t *payload_create_routed(IN const char *data, IN size_t len,
+                                 IN const char *key, IN size_t key_len,
+                                 IN const char *channel, IN size_t channel_len) {
+    if (!data || len == 0) {
+        return NULL;
+    }
+    if (!key) {
+        key_len = 0;
+    }
+    if (!channel) {
+        channel_len = 0;
+    }
+    bool channel_is_key = key_len > 0 && channel == key && channel_len == key_len;
+    size_t meta_len = key_len + (channel_is_key ? 0 : channel_len);
+
+    payload_t *payload = payload_pool_acquire(len + meta_len);
+    if (!payload) {
+        return NULL;
+    }
+    payload->len = len;
+    payload->ingress_us = metrics_now_us();
+    memcpy(payload_data(payload), data, len);
+    payload_data(payload)[len] = '\0';
+
+    char *meta = (char *)payload_data(payload) + len + 1;
+    payload->key = NULL;
+    payload->key_len = key_len;
+    payload->key_hash = 0;
+    if (key_len > 0) {
+        memcpy(meta, key, key_len);
+        payload->key = meta;
+        payload->key_hash = key_hash(key, key_len);
+        meta += key_len;
+    }
+    payload->channel = NULL;
+    payload->channel_len = channel_len;
+    if (channel_is_key) {
+        payload->channel = payload->key;
+    } else if (channel_len > 0) {
+        memcpy(meta, channel, channel_len);
+        payload->channel = meta;
+    }
+    return payload;
+}
+
+payload_t *payload_clone(IN payload_t *payload) {
+    payload_t *copy = payload_create_routed((const char *)payload_data(payload), payload->len,
+                                            payload->key, payload->key_len,
+                                            payload->channel, payload->channel_len);
+    if (!copy) {
+        return NULL;
+    }
+    copy->source_ts_ms = payload->source_ts_ms;
+    copy->ingress_us = payload->ingress_us;
+    copy->dispatch_us = payload->dispatch_us;
+    copy->seq = payload->seq;
+    copy->origin = payload_retain(payload->origin ? payload->origin : payload);
+    return copy;
+}
+
+payload_t *payload_retain(IN payload_t *payload) {
+    if (payload) {
+        atomic_fetch_add_explicit(&payload->refs, 1, memory_order_relaxed);
+    }
+    return payload;
+}
+
+void payload_release(IN payload_t *payload) {
+    if (!payload) {
+        return;
+    }
+    if (atomic_fetch_sub_explicit(&payload->refs, 1, memory_order_acq_rel) == 1) {
+        payload_t *origin = payload->origin;
+        free(atomic_load_explicit(&payload->frame, memory_order_relaxed));
+        payload_pool_put(payload);
+        payload_release(origin);
+    }
+}
@@ -0,0 +1,221 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "../inc/metrics.h"
+#include "../inc/payload_pool.h"
+
+#define CLASS_INIT {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0}
+
+static payload_class_t classes[PAYLOAD_POOL_CLASSES] = {
+    CLASS_INIT, CLASS_INIT, CLASS_INIT, CLASS_INIT, CLASS_INIT, CLASS_INIT,
+    CLASS_INIT, CLASS_INIT, CLASS_INIT, CLASS_INIT, CLASS_INIT
+};
+
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+static _Thread_local payload_thread_cache_t *thread_cache = NULL;
+
+static size_t class_bytes(IN int size_class) {
+    return (size_t)1 << (PAYLOAD_POOL_MIN_SHIFT + size_class);
+}
+
+static int size_class_for(IN size_t bytes) {
+    for (int i = 0; i < PAYLOAD_POOL_CLASSES; i++) {
+        if (bytes <= class_bytes(i)) {
+            return i;
+        }
+    }
+    return PAYLOAD_UNPOOLED;
+}
+
+static size_t thread_limit(IN int size_class) {
+    size_t limit = PAYLOAD_POOL_THREAD_CACHE_BYTES / class_bytes(size_class);
+    if (limit > PAYLOAD_POOL_THREAD_CACHE_MAX) {
+        return PAYLOAD_POOL_THREAD_CACHE_MAX;
+    }
+    return limit < 1 ? 1 : limit;
+}
+
+static size_t global_limit(IN int size_class) {
+    size_t limit = PAYLOAD_POOL_CLASS_CACHE_BYTES / class_bytes(size_class);
+    return limit < PAYLOAD_POOL_MIN_CACHED ? PAYLOAD_POOL_MIN_CACHED : limit;
+}
+
+static void flush(IN int size_class, IN payload_cache_t *cache, IN size_t keep) {
+    payload_class_t *cls = &classes[size_class];
+    payload_t *excess = NULL;
+
+    pthread_mutex_lock(&cls->mutex);
+    while (cache->count > keep) {
+        payload_t *payload = cache->free;
+        cache->free = payload->pool_next;
+        cache->count--;
+        if (cls->count < global_limit(size_class)) {
+            payload->pool_next = cls->free;
+            cls->free = payload;
+            cls->count++;
+        } else {
+            payload->pool_next = excess;
+            excess = payload;
+        }
+    }
+    pthread_mutex_unlock(&cls->mutex);
+
+    while (excess) {
+        payload_t *next = excess->pool_next;
+        free(excess);
+        atomic_fetch_add_explicit(&cls->released, 1, memory_order_relaxed);
+        excess = next;
+    }
+}
+
+static void refill(IN int size_class, IN payload_cache_t *cache) {
+    payload_class_t *cls = &classes[size_class];
+    size_t want = (thread_limit(size_class) + 1) / 2;
+
+    pthread_mutex_lock(&cls->mutex);
+    while (cache->count < want && cls->free) {
+        payload_t *payload = cls->free;
+        cls->free = payload->pool_next;
+        cls->count--;
+        payload->pool_next = cache->free;
+        cache->free = payload;
+        cache->count++;
+    }
+    pthread_mutex_unlock(&cls->mutex);
+}
+
+static void retire_cache(void *ptr) {
+    payload_thread_cache_t *cache = ptr;
+    thread_cache = NULL;
+    for (int i = 0; i < PAYLOAD_POOL_CLASSES; i++) {
+        flush(i, &cache->classes[i], 0);
+    }
+    free(cache);
+}
+
+static void create_cache_key(void) {
+    pthread_key_create(&cache_key, retire_cache);
+}
+
+static payload_thread_cache_t *get_cache(void) {
+    if (thread_cache) {
+        return thread_cache;
+    }
+    payload_thread_cache_t *cache = calloc(1, sizeof(payload_thread_cache_t));
+    if (!cache) {
+        return NULL;
+    }
+    pthread_once(&cache_once, create_cache_key);
+    pthread_setspecific(cache_key, cache);
+    thread_cache = cache;
+    return cache;
+}
+
+static payload_t *take(IN int size_class) {
+    payload_thread_cache_t *threads = get_cache();
+    if (!threads) {
+        return NULL;
+    }
+    payload_cache_t *cache = &threads->classes[size_class];
+    if (!cache->free) {
+        refill(size_class, cache);
+    }
+    payload_t *payload = cache->free;
+    if (payload) {
+        cache->free = payload->pool_next;
+        cache->count--;
+    }
+    return payload;
+}
+
+static void reset(IN payload_t *payload) {
+    atomic_init(&payload->refs, 1);
+    payload->len = 0;
+    payload->key = NULL;
+    payload->key_len = 0;
+    payload->channel = NULL;
+    payload->channel_len = 0;
+    payload->source_ts_ms = 0;
+    payload->ingress_us = 0;
+    payload->dispatch_us = 0;
+    payload->seq = 0;
+    payload->pool_next = NULL;
+    atomic_init(&payload->frame, NULL);
+    payload->commit_slot = NULL;
+    payload->commit_generation = 0;
+    payload->offset = 0;
+    atomic_init(&payload->pending_marks, 0);
+    payload->origin = NULL;
+    payload->spilled = 0;
+}
+
+payload_t *payload_pool_acquire(IN size_t capacity) {
+    int size_class = size_class_for(capacity + 1);
+    size_t bytes = size_class == PAYLOAD_UNPOOLED ? capacity + 1 : class_bytes(size_class);
+    payload_t *payload = size_class == PAYLOAD_UNPOOLED ? NULL : take(size_class);
+
+    if (payload) {
+        metrics_add(METRIC_PAYLOAD_POOL_HITS, 1);
+    } else {
+        payload = malloc(sizeof(payload_t) + PAYLOAD_HEADROOM + bytes);
+        if (!payload) {
+            return NULL;
+        }
+        metrics_add(METRIC_PAYLOAD_POOL_MISSES, 1);
+        if (size_class != PAYLOAD_UNPOOLED) {
+            atomic_fetch_add_explicit(&classes[size_class].allocated, 1, memory_order_relaxed);
+        }
+    }
+    reset(payload);
+    payload->size_class = (uint8_t)size_class;
+    payload->capacity = bytes - 1;
+    return payload;
+}
+
+payload_t *payload_pool_grow(IN payload_t *payload, IN size_t capacity) {
+    if (payload && payload->capacity >= capacity) {
+        return payload;
+    }
+    payload_t *grown = payload_pool_acquire(capacity);
+    if (!grown) {
+        return NULL;
+    }
+    if (payload) {
+        memcpy(payload_data(grown), payload_data(payload), payload->len);
+        grown->len = payload->len;
+        payload_release(payload);
+    }
+    return grown;
+}
+
+void payload_pool_put(IN payload_t *payload) {
+    int size_class = payload->size_class;
+    payload_thread_cache_t *threads = size_class == PAYLOAD_UNPOOLED ? NULL : get_cache();
+
+    if (!threads) {
+        if (size_class != PAYLOAD_UNPOOLED) {
+            atomic_fetch_add_explicit(&classes[size_class].released, 1, memory_order_relaxed);
+        }
+        free(payload);
+        return;
+    }
+    payload_cache_t *cache = &threads->classes[size_class];
+    payload->pool_next = cache->free;
+    cache->free = payload;
+    cache->count++;
+    if (cache->count > thread_limit(size_class)) {
+        flush(size_class, cache, thread_limit(size_class) / 2);
+    }
+}
+
+void payload_pool_stats(IN int size_class, OUT payload_pool_stats_t *stats) {
+    payload_class_t *cls = &classes[size_class];
+
+    stats->bytes = class_bytes(size_class);
+    stats->released = atomic_load_explicit(&cls->released, memory_order_relaxed);
+    stats->allocated = atomic_load_explicit(&cls->allocated, memory_order_relaxed);
+    pthread_mutex_lock(&cls->mutex);
+    stats->cached = cls->count;
+    pthread_mutex_unlock(&cls->mutex);
+}
@@ -0,0 +1,55 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "../inc/replay_ring.h"
+
+int replay_ring_init(IN replay_ring_t *ring, IN size_t capacity) {
+    size_t size = 1;
+
+    memset(ring, 0, sizeof(*ring));
+    if (capacity == 0) {
+        return 0;
+    }
+    while (size < capacity) {
+        size <<= 1;
+    }
+    ring->entries = calloc(size, sizeof(payload_t *));
+    if (!ring->entries) {
+        return -1;
+    }
+    ring->mask = size - 1;
+    return 0;
+}
+
+void replay_ring_destroy(IN replay_ring_t *ring) {
+    if (!ring->entries) {
+        return;
+    }
+    for (uint64_t i = replay_ring_oldest(ring); i < ring->head; i++) {
+        payload_release(replay_ring_at(ring, i));
+    }
+    free(ring->entries);
+    ring->entries = NULL;
+}
+
+void replay_ring_push(IN replay_ring_t *ring, IN payload_t *payload) {
+    if (!ring->entries) {
+        return;
+    }
+    payload_t **slot = &ring->entries[ring->head & ring->mask];
+    if (ring->head > ring->mask) {
+        payload_release(*slot);
+    }
+    *slot = payload_retain(payload);
+    ring->head++;
+}
+
+uint64_t replay_ring_find(IN const replay_ring_t *ring, IN uint64_t last_seq) {
+    uint64_t position = ring->head;
+    uint64_t oldest = replay_ring_oldest(ring);
+
+    while (position > oldest && replay_ring_at(ring, position - 1)->seq > last_seq) {
+        position--;
+    }
+    return position;
+}
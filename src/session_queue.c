@@ -0,0 +1,104 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../inc/session_queue.h"
+
+int session_queue_init(IN session_queue_t *queue, IN uint32_t capacity) {
+    uint32_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    memset(queue, 0, sizeof(*queue));
+    queue->entries = calloc(size, sizeof(msg_t));
+    if (!queue->entries) {
+        return -1;
+    }
+    queue->mask = size - 1;
+    return 0;
+}
+
+void session_queue_destroy(IN session_queue_t *queue) {
+    if (!queue->entries) {
+        return;
+    }
+    while (session_queue_count(queue) > 0) {
+        session_queue_pop(queue);
+    }
+    free(queue->entries);
+    queue->entries = NULL;
+}
+
+bool session_queue_push(IN session_queue_t *queue, IN payload_t *payload, IN uint64_t enqueued_us) {
+    if (!queue->entries || session_queue_full(queue)) {
+        return false;
+    }
+    queue->entries[queue->head & queue->mask].payload = payload;
+    queue->entries[queue->head & queue->mask].enqueued_us = enqueued_us;
+    queue->head++;
+    queue->bytes += payload->len;
+    queue->key_bits |= session_queue_key_bit(payload);
+    return true;
+}
+
+msg_t *session_queue_peek(IN session_queue_t *queue) {
+    if (!queue->entries || session_queue_count(queue) == 0) {
+        return NULL;
+    }
+    return &queue->entries[queue->tail & queue->mask];
+}
+
+msg_t *session_queue_at(IN session_queue_t *queue, IN uint32_t index) {
+    if (!queue->entries || index >= session_queue_count(queue)) {
+        return NULL;
+    }
+    return &queue->entries[(queue->tail + index) & queue->mask];
+}
+
+size_t session_queue_pop(IN session_queue_t *queue) {
+    msg_t *msg = session_queue_peek(queue);
+    if (!msg) {
+        return 0;
+    }
+    size_t len = msg->payload->len;
+    queue->bytes -= len;
+    payload_release(msg->payload);
+    msg->payload = NULL;
+    queue->tail++;
+    if (queue->tail == queue->head) {
+        queue->key_bits = 0;
+    }
+    return len;
+}
+
+msg_t *session_queue_find_key(IN session_queue_t *queue, IN const payload_t *payload) {
+    if (!queue->entries || !(queue->key_bits & session_queue_key_bit(payload))) {
+        return NULL;
+    }
+    for (uint32_t pos = queue->head; pos != queue->tail; pos--) {
+        msg_t *msg = &queue->entries[(pos - 1) & queue->mask];
+        const payload_t *queued = msg->payload;
+        if (queued->key_hash == payload->key_hash && queued->key_len == payload->key_len &&
+            memcmp(queued->key, payload->key, payload->key_len) == 0) {
+            return msg;
+        }
+    }
+    return NULL;
+}
+
+size_t session_queue_remove(IN session_queue_t *queue, IN msg_t *msg) {
+    uint32_t pos = queue->tail + (((uint32_t)(msg - queue->entries) - queue->tail) & queue->mask);
+    size_t len = msg->payload->len;
+
+    payload_release(msg->payload);
+    for (; pos + 1 != queue->head; pos++) {
+        queue->entries[pos & queue->mask] = queue->entries[(pos + 1) & queue->mask];
+    }
+    queue->entries[pos & queue->mask].payload = NULL;
+    queue->head--;
+    queue->bytes -= len;
+    if (queue->tail == queue->head) {
+        queue->key_bits = 0;
+    }
+    return len;
+}
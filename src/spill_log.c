@@ -0,0 +1,349 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../inc/log.h"
+#include "../inc/spill_log.h"
+
+static size_t record_size(IN size_t len) {
+    size_t size = sizeof(spill_record_t) + len;
+    return (size + SPILL_LOG_ALIGN - 1) & ~(size_t)(SPILL_LOG_ALIGN - 1);
+}
+
+static void segment_path(IN const spill_log_t *log, IN uint64_t seq, OUT char *path) {
+    snprintf(path, SPILL_LOG_PATH_MAX, "%s/" SPILL_LOG_PREFIX "%020llu" SPILL_LOG_SUFFIX,
+             log->dir, (unsigned long long)seq);
+}
+
+static int map_segment(IN spill_log_t *log, IN uint64_t seq, OUT spill_segment_t *segment) {
+    char path[SPILL_LOG_PATH_MAX];
+    struct stat st;
+
+    segment_path(log, seq, path);
+    segment->seq = seq;
+    segment->write_off = 0;
+    segment->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (segment->fd < 0) {
+        LOG_ERROR("Failed to open spill segment %s: %s", path, strerror(errno));
+        return -1;
+    }
+    if (fstat(segment->fd, &st) != 0 ||
+        ((size_t)st.st_size < log->segment_size && ftruncate(segment->fd, (off_t)log->segment_size) != 0)) {
+        LOG_ERROR("Failed to size spill segment %s: %s", path, strerror(errno));
+        close(segment->fd);
+        return -1;
+    }
+    segment->base = mmap(NULL, log->segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, segment->fd, 0);
+    if (segment->base == MAP_FAILED) {
+        LOG_ERROR("Failed to map spill segment %s: %s", path, strerror(errno));
+        close(segment->fd);
+        return -1;
+    }
+    return 0;
+}
+
+static void remove_segment(IN const spill_log_t *log, IN uint64_t seq) {
+    char path[SPILL_LOG_PATH_MAX];
+
+    segment_path(log, seq, path);
+    unlink(path);
+}
+
+static void unmap_segment(IN spill_log_t *log, IN spill_segment_t *segment, IN bool remove) {
+    munmap(segment->base, log->segment_size);
+    close(segment->fd);
+    if (remove) {
+        remove_segment(log, segment->seq);
+    }
+}
+
+static size_t scan_segment(IN spill_log_t *log, IN spill_segment_t *segment, IN size_t start) {
+    size_t records = 0;
+    spill_record_t record;
+
+    while (segment->write_off + sizeof(record) <= log->segment_size) {
+        memcpy(&record, segment->base + segment->write_off, sizeof(record));
+        if (record.len == 0 || segment->write_off + record_size(record.len) > log->segment_size) {
+            break;
+        }
+        if (segment->write_off >= start) {
+            records++;
+        }
+        segment->write_off += record_size(record.len);
+    }
+    return records;
+}
+
+static int open_cursor(IN spill_log_t *log, OUT spill_cursor_t *cursor) {
+    char path[SPILL_LOG_PATH_MAX];
+
+    memset(cursor, 0, sizeof(*cursor));
+    snprintf(path, sizeof(path), "%s/" SPILL_LOG_CURSOR, log->dir);
+    log->cursor_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (log->cursor_fd < 0) {
+        LOG_ERROR("Failed to open spill cursor %s: %s", path, strerror(errno));
+        return -1;
+    }
+    if (pread(log->cursor_fd, cursor, sizeof(*cursor), 0) != (ssize_t)sizeof(*cursor)) {
+        memset(cursor, 0, sizeof(*cursor));
+    }
+    return 0;
+}
+
+static void save_cursor(IN spill_log_t *log) {
+    spill_cursor_t cursor = {log->segments[0].seq, log->commit_off};
+
+    if (pwrite(log->cursor_fd, &cursor, sizeof(cursor), 0) != (ssize_t)sizeof(cursor)) {
+        LOG_WARN("Failed to save spill cursor: %s", strerror(errno));
+    }
+}
+
+static int compare_seq(IN const void *a, IN const void *b) {
+    uint64_t lhs = *(const uint64_t *)a;
+    uint64_t rhs = *(const uint64_t *)b;
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+static size_t list_segments(IN const char *dir, OUT uint64_t **seqs) {
+    size_t count = 0;
+    size_t capacity = 0;
+    struct dirent *entry;
+    DIR *handle = opendir(dir);
+
+    *seqs = NULL;
+    if (!handle) {
+        return 0;
+    }
+    while ((entry = readdir(handle)) != NULL) {
+        char *end;
+        if (strncmp(entry->d_name, SPILL_LOG_PREFIX, strlen(SPILL_LOG_PREFIX)) != 0) {
+            continue;
+        }
+        uint64_t seq = strtoull(entry->d_name + strlen(SPILL_LOG_PREFIX), &end, 10);
+        if (strcmp(end, SPILL_LOG_SUFFIX) != 0) {
+            continue;
+        }
+        if (count == capacity) {
+            size_t grown = capacity ? capacity * 2 : SPILL_LOG_MIN_SEGMENTS;
+            uint64_t *resized = realloc(*seqs, grown * sizeof(uint64_t));
+            if (!resized) {
+                break;
+            }
+            *seqs = resized;
+            capacity = grown;
+        }
+        (*seqs)[count++] = seq;
+    }
+    closedir(handle);
+    if (count > 1) {
+        qsort(*seqs, count, sizeof(uint64_t), compare_seq);
+    }
+    return count;
+}
+
+static int recover_segments(IN spill_log_t *log) {
+    uint64_t *seqs;
+    spill_cursor_t cursor;
+    size_t count = list_segments(log->dir, &seqs);
+    size_t records = 0;
+
+    log->segment_capacity = log->max_segments + count;
+    log->segments = calloc(log->segment_capacity, sizeof(spill_segment_t));
+    if (!log->segments || open_cursor(log, &cursor) != 0) {
+        free(seqs);
+        return -1;
+    }
+    log->next_seq = cursor.seq + 1;
+    for (size_t i = 0; i < count; i++) {
+        spill_segment_t *segment = &log->segments[log->segment_count];
+        size_t start = seqs[i] == cursor.seq ? (size_t)cursor.off : 0;
+        if (seqs[i] >= log->next_seq) {
+            log->next_seq = seqs[i] + 1;
+        }
+        if (seqs[i] < cursor.seq) {
+            remove_segment(log, seqs[i]);
+            continue;
+        }
+        if (map_segment(log, seqs[i], segment) != 0) {
+            continue;
+        }
+        size_t found = scan_segment(log, segment, start);
+        if (found == 0) {
+            unmap_segment(log, segment, true);
+            continue;
+        }
+        if (log->segment_count == 0) {
+            log->commit_off = start;
+            log->read_off = start;
+        }
+        records += found;
+        log->segment_count++;
+    }
+    free(seqs);
+    atomic_init(&log->pending, records);
+    if (records > 0) {
+        LOG_INFO("Recovered %zu spilled messages from %zu segments in %s",
+                 records, log->segment_count, log->dir);
+    }
+    return 0;
+}
+
+spill_log_t *spill_log_open(IN const char *dir, IN size_t segment_size, IN size_t max_bytes) {
+    if (!dir || !dir[0] || segment_size <= sizeof(spill_record_t)) {
+        return NULL;
+    }
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+        LOG_ERROR("Failed to create spill directory %s: %s", dir, strerror(errno));
+        return NULL;
+    }
+
+    spill_log_t *log = calloc(1, sizeof(spill_log_t));
+    if (!log) {
+        return NULL;
+    }
+    log->dir = strdup(dir);
+    log->cursor_fd = -1;
+    log->segment_size = segment_size & ~(size_t)(SPILL_LOG_ALIGN - 1);
+    log->max_segments = max_bytes / log->segment_size;
+    if (log->max_segments < SPILL_LOG_MIN_SEGMENTS) {
+        log->max_segments = SPILL_LOG_MIN_SEGMENTS;
+    }
+    if (!log->dir || pthread_mutex_init(&log->mutex, NULL) != 0) {
+        free(log->dir);
+        free(log);
+        return NULL;
+    }
+    if (recover_segments(log) != 0) {
+        spill_log_close(log);
+        return NULL;
+    }
+    return log;
+}
+
+void spill_log_close(IN spill_log_t *log) {
+    if (!log) {
+        return;
+    }
+    char path[SPILL_LOG_PATH_MAX];
+    bool drained = spill_log_pending(log) == 0;
+    for (size_t i = 0; i < log->segment_count; i++) {
+        unmap_segment(log, &log->segments[i], drained);
+    }
+    if (log->cursor_fd >= 0) {
+        close(log->cursor_fd);
+        if (drained) {
+            snprintf(path, sizeof(path), "%s/" SPILL_LOG_CURSOR, log->dir);
+            unlink(path);
+        }
+    }
+    pthread_mutex_destroy(&log->mutex);
+    free(log->segments);
+    free(log->dir);
+    free(log);
+}
+
+bool spill_log_append(IN spill_log_t *log, IN const char *data, IN size_t len) {
+    size_t size = record_size(len);
+    spill_record_t record = {(uint32_t)len, 0};
+
+    if (!log || len == 0 || len > UINT32_MAX || size > log->segment_size) {
+        return false;
+    }
+
+    pthread_mutex_lock(&log->mutex);
+    spill_segment_t *tail = log->segment_count ? &log->segments[log->segment_count - 1] : NULL;
+    if (!tail || tail->write_off + size > log->segment_size) {
+        if (log->segment_count >= log->max_segments ||
+            map_segment(log, log->next_seq, &log->segments[log->segment_count]) != 0) {
+            pthread_mutex_unlock(&log->mutex);
+            return false;
+        }
+        tail = &log->segments[log->segment_count++];
+        log->next_seq++;
+    }
+    memcpy(tail->base + tail->write_off + sizeof(record), data, len);
+    memcpy(tail->base + tail->write_off, &record, sizeof(record));
+    tail->write_off += size;
+    atomic_fetch_add_explicit(&log->pending, 1, memory_order_release);
+    pthread_mutex_unlock(&log->mutex);
+    return true;
+}
+
+size_t spill_log_read(IN spill_log_t *log, OUT payload_t **payloads, IN size_t max) {
+    size_t count = 0;
+    spill_record_t record;
+
+    pthread_mutex_lock(&log->mutex);
+    while (count < max && !log->failed && log->read_index < log->segment_count) {
+        spill_segment_t *segment = &log->segments[log->read_index];
+        if (log->read_off >= segment->write_off) {
+            if (log->read_index + 1 == log->segment_count) {
+                break;
+            }
+            log->read_index++;
+            log->read_off = 0;
+            continue;
+        }
+        memcpy(&record, segment->base + log->read_off, sizeof(record));
+        payload_t *payload = payload_create((const char *)segment->base + log->read_off + sizeof(record),
+                                            record.len);
+        if (!payload) {
+            break;
+        }
+        payload->spilled = 1;
+        payloads[count++] = payload;
+        log->read_off += record_size(record.len);
+    }
+    log->window += count;
+    log->in_flight += count;
+    pthread_mutex_unlock(&log->mutex);
+    return count;
+}
+
+static void commit_window(IN spill_log_t *log) {
+    for (size_t i = 0; i < log->read_index; i++) {
+        unmap_segment(log, &log->segments[i], true);
+    }
+    if (log->read_index > 0) {
+        memmove(&log->segments[0], &log->segments[log->read_index],
+                (log->segment_count - log->read_index) * sizeof(spill_segment_t));
+        log->segment_count -= log->read_index;
+        log->read_index = 0;
+    }
+    log->commit_off = log->read_off;
+    atomic_fetch_sub_explicit(&log->pending, log->window, memory_order_release);
+    save_cursor(log);
+}
+
+bool spill_log_ack(IN spill_log_t *log, IN bool delivered) {
+    bool rewound = false;
+
+    pthread_mutex_lock(&log->mutex);
+    log->failed |= !delivered;
+    if (log->in_flight > 0 && --log->in_flight == 0) {
+        if (log->failed) {
+            log->read_index = 0;
+            log->read_off = log->commit_off;
+            log->failed = false;
+            rewound = true;
+        } else {
+            commit_window(log);
+        }
+        log->window = 0;
+    }
+    pthread_mutex_unlock(&log->mutex);
+    return rewound;
+}
+
+size_t spill_log_in_flight(IN spill_log_t *log) {
+    pthread_mutex_lock(&log->mutex);
+    size_t in_flight = log->in_flight;
+    pthread_mutex_unlock(&log->mutex);
+    return in_flight;
+}
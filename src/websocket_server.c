@@ -1,90 +1,539 @@
+
 #include <libwebsockets.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "../inc/fanout.h"
 #include "../inc/log.h"
 #include "../inc/message_queue.h"
+#include "../inc/metrics.h"
+#include "../inc/offset_tracker.h"
+#include "../inc/payload.h"
+#include "../inc/payload_pool.h"
 #include "../inc/websocket_server.h"
 
-static websocket_server_t *g_server = NULL;
+static ws_shard_t *shard_from_wsi(IN struct lws *wsi) {
+    return (ws_shard_t *)lws_context_user(lws_get_context(wsi));
+}
+
+static void subscribe_from_path(IN ws_shard_t *shard, IN session_t *pss, IN struct lws *wsi) {
+    char path[WEBSOCKET_PATH_MAX];
+    const char *cursor = path;
 
-static void destroy_message(IN void *ptr) {
-    msg_t *m = (msg_t *)ptr;
-    free(m->payload);
+    pss->subscription_count = 0;
+    if (lws_hdr_copy(wsi, path, sizeof(path), WSI_TOKEN_GET_URI) <= 0) {
+        path[0] = '\0';
+    }
+    while (*cursor == '/') {
+        cursor++;
+    }
+    if (*cursor == '\0' || strcmp(cursor, CHANNEL_WILDCARD) == 0) {
+        fanout_subscribe(shard, pss, CHANNEL_WILDCARD, strlen(CHANNEL_WILDCARD));
+        return;
+    }
+
+    while (*cursor) {
+        const char *end = strchr(cursor, WEBSOCKET_CHANNEL_SEPARATOR);
+        size_t len = end ? (size_t)(end - cursor) : strlen(cursor);
+        if (len > 0) {
+            fanout_subscribe(shard, pss, cursor, len);
+        }
+        cursor += len;
+        if (*cursor == WEBSOCKET_CHANNEL_SEPARATOR) {
+            cursor++;
+        }
+    }
 }
 
-static void append_client(IN session_t *pss) {
-    pthread_mutex_lock(&g_server->clients_lock);
-    pss->next = g_server->clients;
-    if (g_server->clients) {
-        g_server->clients->prev = pss;
+static void drain_inbox(IN ws_shard_t *shard) {
+    payload_t *payload = NULL;
+
+    message_queue_clear_wakeup(shard->inbox);
+    while (message_queue_try_pop(shard->inbox, &payload)) {
+        fanout_broadcast(shard, payload);
+        offset_tracker_mark(payload);
+        payload_release(payload);
     }
-    g_server->clients = pss;
-    pthread_mutex_unlock(&g_server->clients_lock);
 }
 
-static void remove_client(IN session_t *pss) {
-    pthread_mutex_lock(&g_server->clients_lock);
-    if (pss->prev) {
-        pss->prev->next = pss->next;
-    } else {
-        g_server->clients = pss->next;
+static void resume_from_args(IN ws_shard_t *shard, IN session_t *pss, IN struct lws *wsi) {
+    char value[WEBSOCKET_ARG_MAX];
+    char epoch[WEBSOCKET_ARG_MAX];
+
+    if (lws_get_urlarg_by_name_safe(wsi, WEBSOCKET_LAST_SEQ_ARG, value, sizeof(value)) > 0) {
+        if (lws_get_urlarg_by_name_safe(wsi, WEBSOCKET_EPOCH_ARG, epoch, sizeof(epoch)) <= 0) {
+            epoch[0] = '\0';
+        }
+        fanout_resume(shard, pss, strtoull(value, NULL, 10), strtoull(epoch, NULL, 10));
+    } else if (lws_get_urlarg_by_name_safe(wsi, WEBSOCKET_SEQ_ARG, value, sizeof(value)) >= 0) {
+        pss->sequenced = true;
     }
-    if (pss->next) {
-        pss->next->prev = pss->prev;
+}
+
+static void select_format(IN session_t *pss, IN struct lws *wsi) {
+    const char *protocol = lws_get_protocol(wsi)->name;
+    char value[WEBSOCKET_ARG_MAX];
+
+    pss->enveloped = strcmp(protocol, WEBSOCKET_PROTOCOL_ENVELOPE) == 0;
+    pss->binary = pss->enveloped || strcmp(protocol, WEBSOCKET_PROTOCOL_BINARY) == 0;
+    if (lws_get_urlarg_by_name_safe(wsi, WEBSOCKET_FORMAT_ARG, value, sizeof(value)) > 0) {
+        pss->enveloped = strcmp(value, WEBSOCKET_FORMAT_ENVELOPE) == 0;
+        pss->binary = pss->enveloped || strcmp(value, WEBSOCKET_FORMAT_BINARY) == 0;
     }
-    pthread_mutex_unlock(&g_server->clients_lock);
 }
 
-static int broadcast_to_clients(IN const char *data, IN size_t len) {
-    if (!data || len == 0) {
+static int filter_from_args(IN ws_shard_t *shard, IN session_t *pss, IN struct lws *wsi) {
+    char expr[FILTER_ARG_MAX];
+
+    pss->filter = NULL;
+    if (lws_get_urlarg_by_name_safe(wsi, FILTER_ARG, expr, sizeof(expr)) <= 0) {
         return 0;
     }
-    int delivered = 0;
-    msg_t amsg;
-    pthread_mutex_lock(&g_server->clients_lock);
-    session_t *pss = g_server->clients;
-    while (pss) {
-        amsg.len = len;
-        amsg.payload = malloc(LWS_PRE + len);
-        if (!amsg.payload) {
-            pss = pss->next;
-            continue;
+    pss->filter = filter_compile(&shard->filters, expr, strlen(expr));
+    if (!pss->filter) {
+        LOG_WARN("%s", "Connection rejected: invalid filter");
+        return -1;
+    }
+    return 0;
+}
+
+static bool primary_protocol(IN struct lws *wsi) {
+    return strcmp(lws_get_protocol(wsi)->name, WEBSOCKET_PROTOCOL_TEXT) == 0;
+}
+
+static void post_to_shards(IN websocket_server_t *server, IN payload_t *payload, IN bool blocking) {
+    payload->seq = atomic_fetch_add_explicit(&server->next_seq, 1, memory_order_relaxed) + 1;
+    payload->dispatch_us = metrics_now_us();
+    atomic_store_explicit(&payload->pending_marks, (unsigned)server->shard_count, memory_order_relaxed);
+    for (int i = 0; i < server->shard_count; i++) {
+        message_queue_t *inbox = server->shards[i].inbox;
+        payload_t *copy = i == 0 ? payload_retain(payload) : payload_clone(payload);
+        bool posted = copy && (blocking ? message_queue_push_payload(inbox, copy)
+                                        : message_queue_try_push_payload(inbox, copy));
+        if (!posted) {
+            offset_tracker_mark(payload);
+            payload_release(copy);
+            metrics_add(METRIC_SHARD_INBOX_DROPS, 1);
+            LOG_WARN("Dropping broadcast for shard %d; inbox unavailable", i);
         }
-        
-        memset(amsg.payload, 0, LWS_PRE);
-        memcpy((unsigned char *)amsg.payload + LWS_PRE, data, len);
-        if (lws_ring_insert(pss->ring, &amsg, 1) != 1) {
-            destroy_message(&amsg);
-        } else {
-            delivered++;
+    }
+}
+
+static void record_sent(IN websocket_server_t *server, IN session_t *pss) {
+    msg_t *msg = session_queue_peek(&pss->queue);
+    uint64_t now_us = metrics_now_us();
+
+    metrics_record_since(METRIC_LATENCY_SESSION_QUEUE, msg->enqueued_us, now_us);
+    metrics_record_since(METRIC_LATENCY_INGRESS_TO_SOCKET, msg->payload->ingress_us, now_us);
+    if (msg->payload->source_ts_ms > 0) {
+        metrics_record_since(METRIC_LATENCY_KAFKA_TO_SOCKET,
+                             (uint64_t)msg->payload->source_ts_ms * 1000u, metrics_wall_ms() * 1000u);
+    }
+    pss->stats.sent_messages++;
+    pss->stats.sent_bytes += fanout_pop(server, pss);
+}
+
+static void negotiate_deflate(IN ws_shard_t *shard, IN session_t *pss, IN struct lws *wsi) {
+    const deflate_options_t *deflate = &shard->server->deflate;
+    char level[WEBSOCKET_ARG_MAX];
+    char offer[WEBSOCKET_PATH_MAX];
+
+    pss->shared_deflate = false;
+    if (!deflate->enabled) {
+        return;
+    }
+    snprintf(level, sizeof(level), "%d", deflate->level);
+    if (lws_set_extension_option(wsi, WEBSOCKET_DEFLATE_EXTENSION, WEBSOCKET_DEFLATE_LEVEL_OPTION, level) != 0) {
+        return;
+    }
+    if (lws_hdr_copy(wsi, offer, sizeof(offer), WSI_TOKEN_EXTENSIONS) <= 0) {
+        offer[0] = '\0';
+    }
+    const char *bits = strstr(offer, WEBSOCKET_DEFLATE_WINDOW_PARAM);
+    bool full_window = !bits || atoi(bits + strlen(WEBSOCKET_DEFLATE_WINDOW_PARAM)) >= DEFLATE_FRAME_WINDOW_BITS;
+    if (full_window && shard->deflate.ready && shard->server->write.batch == WRITE_BATCH_NONE &&
+        !pss->sequenced && !pss->binary) {
+        pss->shared_deflate = true;
+        return;
+    }
+    metrics_add(METRIC_DEFLATE_FALLBACKS, 1);
+}
+
+static int write_shared(IN ws_shard_t *shard, IN session_t *pss) {
+    msg_t *msg = session_queue_peek(&pss->queue);
+    payload_frame_t *frame = deflate_frame_get(&shard->deflate, msg->payload);
+
+    if (!frame) {
+        LOG_WARN("%s", "Failed to build shared WebSocket frame");
+        return -1;
+    }
+    if (lws_write(pss->wsi, frame->start, frame->len, LWS_WRITE_RAW) < (int)frame->len) {
+        LOG_WARN("%s", "Failed to write WebSocket frame");
+        return -1;
+    }
+    metrics_add(METRIC_FRAMES_WRITTEN, 1);
+    metrics_add(METRIC_BYTES_WRITTEN, frame->len);
+    record_sent(shard->server, pss);
+    return (int)frame->len;
+}
+
+static bool reserve_write_buffer(IN ws_shard_t *shard, IN size_t len) {
+    if (shard->write_buffer_size >= PAYLOAD_HEADROOM + len) {
+        return true;
+    }
+    unsigned char *buffer = realloc(shard->write_buffer, PAYLOAD_HEADROOM + len);
+    if (!buffer) {
+        return false;
+    }
+    shard->write_buffer = buffer;
+    shard->write_buffer_size = PAYLOAD_HEADROOM + len;
+    return true;
+}
+
+static int write_single(IN ws_shard_t *shard, IN session_t *pss) {
+    msg_t *msg = session_queue_peek(&pss->queue);
+    size_t len = msg->payload->len;
+
+    if (pss->shared_deflate) {
+        return write_shared(shard, pss);
+    }
+
+    if (lws_write(pss->wsi, payload_data(msg->payload), len,
+                  pss->binary ? LWS_WRITE_BINARY : LWS_WRITE_TEXT) < (int)len) {
+        LOG_WARN("%s", "Failed to write WebSocket frame");
+        return -1;
+    }
+    metrics_add(METRIC_FRAMES_WRITTEN, 1);
+    metrics_add(METRIC_BYTES_WRITTEN, len);
+    record_sent(shard->server, pss);
+    return (int)len;
+}
+
+static write_batch_mode_t session_batch_mode(IN const ws_shard_t *shard, IN const session_t *pss) {
+    write_batch_mode_t mode = shard->server->write.batch;
+    return pss->binary && mode == WRITE_BATCH_JSON ? WRITE_BATCH_BINARY : mode;
+}
+
+static size_t field_len(IN size_t len) {
+    return len > UINT16_MAX ? UINT16_MAX : len;
+}
+
+static size_t header_len(IN bool binary, IN const session_t *pss, IN const payload_t *payload) {
+    if (pss->enveloped) {
+        return WEBSOCKET_EPOCH_LEN + WEBSOCKET_SEQ_LEN + 2 * WEBSOCKET_FIELD_LEN + field_len(payload->channel_len) + field_len(payload->key_len);
+    }
+    if (!pss->sequenced) {
+        return 0;
+    }
+    return binary ? WEBSOCKET_EPOCH_LEN + WEBSOCKET_SEQ_LEN : WEBSOCKET_ENVELOPE_MAX;
+}
+
+static size_t message_overhead(IN write_batch_mode_t mode, IN const session_t *pss, IN const payload_t *payload) {
+    bool binary = mode == WRITE_BATCH_BINARY || pss->binary;
+    size_t separator = mode == WRITE_BATCH_BINARY ? WEBSOCKET_BATCH_PREFIX_LEN : mode == WRITE_BATCH_JSON ? 1 : 0;
+    return separator + header_len(binary, pss, payload);
+}
+
+static unsigned char *put_be(IN unsigned char *out, IN uint64_t value, IN int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+        *out++ = (unsigned char)(value >> (i * 8));
+    }
+    return out;
+}
+
+static unsigned char *put_field(IN unsigned char *out, IN const char *value, IN size_t len) {
+    len = field_len(len);
+    out = put_be(out, len, WEBSOCKET_FIELD_LEN);
+    if (len > 0) {
+        memcpy(out, value, len);
+    }
+    return out + len;
+}
+
+static unsigned char *put_message(IN unsigned char *out,
+                                  IN write_batch_mode_t mode,
+                                  IN const session_t *pss,
+                                  IN uint64_t epoch,
+                                  IN payload_t *payload) {
+    bool binary = mode == WRITE_BATCH_BINARY || pss->binary;
+
+    if (mode == WRITE_BATCH_BINARY) {
+        out = put_be(out, payload->len + header_len(true, pss, payload), WEBSOCKET_BATCH_PREFIX_LEN);
+    }
+    if (pss->enveloped) {
+        out = put_be(out, epoch, WEBSOCKET_EPOCH_LEN);
+        out = put_be(out, payload->seq, WEBSOCKET_SEQ_LEN);
+        out = put_field(out, payload->channel, payload->channel_len);
+        out = put_field(out, payload->key, payload->key_len);
+    } else if (pss->sequenced && binary) {
+        out = put_be(out, epoch, WEBSOCKET_EPOCH_LEN);
+        out = put_be(out, payload->seq, WEBSOCKET_SEQ_LEN);
+    } else if (pss->sequenced) {
+        out += sprintf((char *)out, WEBSOCKET_ENVELOPE_PREFIX,
+                       (unsigned long long)epoch, (unsigned long long)payload->seq);
+    }
+    memcpy(out, payload_data(payload), payload->len);
+    out += payload->len;
+    if (!binary && pss->sequenced) {
+        *out++ = '}';
+    }
+    return out;
+}
+
+static int write_batch(IN ws_shard_t *shard, IN session_t *pss, IN size_t budget) {
+    write_batch_mode_t mode = session_batch_mode(shard, pss);
+    uint32_t queued = mode == WRITE_BATCH_NONE ? 1 : session_queue_count(&pss->queue);
+    uint32_t count = 1;
+    payload_t *first = session_queue_peek(&pss->queue)->payload;
+    size_t bytes = first->len + message_overhead(mode, pss, first) + (mode == WRITE_BATCH_JSON ? 1 : 0);
+
+    while (count < queued) {
+        payload_t *next = session_queue_at(&pss->queue, count)->payload;
+        size_t next_len = next->len + message_overhead(mode, pss, next);
+        if (bytes + next_len > budget) {
+            break;
+        }
+        bytes += next_len;
+        count++;
+    }
+
+    if (!reserve_write_buffer(shard, bytes)) {
+        LOG_WARN("%s", "Failed to allocate WebSocket batch buffer");
+        return -1;
+    }
+
+    unsigned char *start = shard->write_buffer + PAYLOAD_HEADROOM;
+    unsigned char *out = start;
+    if (mode == WRITE_BATCH_JSON) {
+        *out++ = '[';
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        if (mode == WRITE_BATCH_JSON && i > 0) {
+            *out++ = ',';
+        }
+        out = put_message(out, mode, pss, shard->server->epoch, session_queue_at(&pss->queue, i)->payload);
+    }
+    if (mode == WRITE_BATCH_JSON) {
+        *out++ = ']';
+    }
+
+    size_t frame_len = (size_t)(out - start);
+    if (lws_write(pss->wsi, shard->write_buffer + PAYLOAD_HEADROOM, frame_len,
+                  mode == WRITE_BATCH_BINARY || pss->binary ? LWS_WRITE_BINARY : LWS_WRITE_TEXT) < (int)frame_len) {
+        LOG_WARN("%s", "Failed to write WebSocket batch");
+        return -1;
+    }
+    metrics_add(METRIC_FRAMES_WRITTEN, 1);
+    metrics_add(METRIC_BYTES_WRITTEN, frame_len);
+    for (uint32_t i = 0; i < count; i++) {
+        record_sent(shard->server, pss);
+    }
+    return (int)frame_len;
+}
+
+static int write_session(IN ws_shard_t *shard, IN session_t *pss) {
+    const write_options_t *opts = &shard->server->write;
+    size_t written = 0;
+
+    while (written < opts->budget) {
+        if (pss->replaying) {
+            fanout_replay(shard, pss);
+        }
+        if (session_queue_count(&pss->queue) == 0) {
+            break;
+        }
+        int sent = opts->batch == WRITE_BATCH_NONE && !pss->sequenced && !pss->enveloped
+                       ? write_single(shard, pss)
+                       : write_batch(shard, pss, opts->budget - written);
+        if (sent < 0) {
+            return -1;
+        }
+        written += (size_t)sent;
+        if (lws_send_pipe_choked(pss->wsi)) {
+            break;
         }
-        pss = pss->next;
     }
-    pthread_mutex_unlock(&g_server->clients_lock);
 
-    if (delivered > 0) {
-        lws_callback_on_writable_all_protocol(g_server->context, g_server->protocol);
+    if (session_queue_count(&pss->queue) > 0 || pss->replaying) {
+        lws_callback_on_writable(pss->wsi);
+    } else {
+        pss->over_budget_since_ms = 0;
     }
-    return delivered;
+    return 0;
+}
+
+static int serve_metrics(IN struct lws *wsi) {
+    unsigned char headers[LWS_PRE + WEBSOCKET_HTTP_HEADER_SIZE];
+    unsigned char *start = headers + LWS_PRE;
+    unsigned char *p = start;
+    unsigned char *end = headers + sizeof(headers) - 1;
+    size_t len = 0;
+    unsigned char *body = (unsigned char *)metrics_render(LWS_PRE, &len);
+
+    if (!body) {
+        lws_return_http_status(wsi, HTTP_STATUS_INTERNAL_SERVER_ERROR, NULL);
+        return -1;
+    }
+    if (lws_add_http_common_headers(wsi, HTTP_STATUS_OK, METRICS_CONTENT_TYPE,
+                                    (long long)len, &p, end) ||
+        lws_finalize_write_http_header(wsi, start, &p, end) ||
+        lws_write(wsi, body + LWS_PRE, len, LWS_WRITE_HTTP_FINAL) < (int)len) {
+        free(body);
+        return -1;
+    }
+    free(body);
+    return lws_http_transaction_completed(wsi) ? -1 : 0;
+}
+
+static int serve_http(IN struct lws *wsi, IN const char *uri) {
+    if (uri && strcmp(uri, METRICS_PATH) == 0) {
+        return serve_metrics(wsi);
+    }
+    lws_return_http_status(wsi, HTTP_STATUS_NOT_FOUND, NULL);
+    return lws_http_transaction_completed(wsi) ? -1 : 0;
+}
+
+static int reassemble(IN ws_shard_t *shard,
+                      IN session_t *pss,
+                      IN struct lws *wsi,
+                      IN const void *in,
+                      IN size_t len,
+                      OUT payload_t **message) {
+    size_t received = (pss->rx ? pss->rx->len : 0) + len;
+    size_t expected = received + lws_remaining_packet_payload(wsi);
+    bool complete = lws_is_final_fragment(wsi) && lws_remaining_packet_payload(wsi) == 0;
+
+    if (expected > shard->server->max_message_bytes) {
+        LOG_WARN("Closing session; message of at least %zu bytes exceeds %zu",
+                 expected, shard->server->max_message_bytes);
+        metrics_add(METRIC_OVERSIZED_MESSAGES, 1);
+        payload_release(pss->rx);
+        pss->rx = NULL;
+        lws_close_reason(wsi, LWS_CLOSE_STATUS_MESSAGE_TOO_LARGE, NULL, 0);
+        return -1;
+    }
+    if (len > 0) {
+        payload_t *rx = payload_pool_grow(pss->rx, expected);
+        if (!rx) {
+            LOG_WARN("%s", "Dropping WebSocket message; payload allocation failed");
+            payload_release(pss->rx);
+            pss->rx = NULL;
+            return 0;
+        }
+        memcpy(payload_data(rx) + rx->len, in, len);
+        rx->len += len;
+        pss->rx = rx;
+    }
+    if (!complete || !pss->rx) {
+        return 0;
+    }
+    payload_data(pss->rx)[pss->rx->len] = '\0';
+    pss->rx->ingress_us = metrics_now_us();
+    *message = pss->rx;
+    pss->rx = NULL;
+    return 0;
+}
+
+static void spill_message(IN websocket_server_t *server, IN payload_t *payload) {
+    if (server->spill && spill_log_append(server->spill, (const char *)payload_data(payload), payload->len)) {
+        metrics_add(METRIC_SPILLED, 1);
+        return;
+    }
+    metrics_add(METRIC_PRODUCER_QUEUE_DROPS, 1);
+    LOG_WARN("%s", "Producer queue full; dropping message for Kafka");
+}
+
+static void resume_reads(IN lws_sorted_usec_list_t *sul) {
+    ws_shard_t *shard = lws_container_of(sul, ws_shard_t, rx_resume);
+    size_t depth = message_queue_size(shard->server->producer_queue);
+
+    if (shard->rx_paused == 0) {
+        return;
+    }
+    if (depth > shard->server->ingress.resume_at) {
+        lws_sul_schedule(shard->context, 0, &shard->rx_resume, resume_reads,
+                         WEBSOCKET_RX_RESUME_CHECK_MS * LWS_US_PER_MS);
+        return;
+    }
+    for (session_t *pss = shard->clients; pss; pss = pss->next) {
+        if (pss->rx_paused) {
+            pss->rx_paused = false;
+            lws_rx_flow_control(pss->wsi, 1);
+        }
+    }
+    metrics_gauge_add(METRIC_SESSIONS_RX_PAUSED, -(int64_t)shard->rx_paused);
+    LOG_INFO("Producer queue at %zu; resumed reading from %zu sessions on shard %d",
+             depth, shard->rx_paused, shard->index);
+    shard->rx_paused = 0;
+}
+
+static void pause_reads(IN ws_shard_t *shard, IN session_t *pss) {
+    if (pss->rx_paused ||
+        message_queue_size(shard->server->producer_queue) < shard->server->ingress.pause_at) {
+        return;
+    }
+    pss->rx_paused = true;
+    lws_rx_flow_control(pss->wsi, 0);
+    metrics_gauge_add(METRIC_SESSIONS_RX_PAUSED, 1);
+    if (shard->rx_paused++ == 0) {
+        lws_sul_schedule(shard->context, 0, &shard->rx_resume, resume_reads,
+                         WEBSOCKET_RX_RESUME_CHECK_MS * LWS_US_PER_MS);
+    }
+}
+
+static void close_session(IN ws_shard_t *shard, IN session_t *pss) {
+    payload_release(pss->rx);
+    pss->rx = NULL;
+    if (pss->rx_paused) {
+        pss->rx_paused = false;
+        metrics_gauge_add(METRIC_SESSIONS_RX_PAUSED, -1);
+        if (--shard->rx_paused == 0) {
+            lws_sul_cancel(&shard->rx_resume);
+        }
+    }
+    if (pss->stats.dropped_messages > 0 || pss->stats.conflated_messages > 0) {
+        LOG_WARN("Session closed after dropping %llu messages (%llu bytes), conflating %llu, sent %llu",
+                 (unsigned long long)pss->stats.dropped_messages,
+                 (unsigned long long)pss->stats.dropped_bytes,
+                 (unsigned long long)pss->stats.conflated_messages,
+                 (unsigned long long)pss->stats.sent_messages);
+    }
+    fanout_detach(shard, pss);
+    filter_destroy(&shard->filters, pss->filter);
+    pss->filter = NULL;
+}
+
+static void wake_shard(IN void *ctx) {
+    ws_shard_t *shard = (ws_shard_t *)ctx;
+    lws_cancel_service(shard->context);
 }
 
 static int callback_ws(IN struct lws *wsi, IN enum lws_callback_reasons reason,
                        IN void *user, IN void *in, IN size_t len) {
     session_t *pss = (session_t *)user;
-    int m;
-    const msg_t *pmsg;
+    ws_shard_t *shard = wsi ? shard_from_wsi(wsi) : NULL;
+
+    if (!shard) {
+        return 0;
+    }
 
     switch (reason) {
         case LWS_CALLBACK_PROTOCOL_INIT:
-            LOG_INFO("%s","WebSocket protocol initialized");
+            LOG_INFO("WebSocket protocol %s initialized on shard %d", lws_get_protocol(wsi)->name, shard->index);
+            break;
+
+        case LWS_CALLBACK_EVENT_WAIT_CANCELLED:
+            if (primary_protocol(wsi)) {
+                drain_inbox(shard);
+            }
             break;
 
         case LWS_CALLBACK_FILTER_PROTOCOL_CONNECTION: {
-            const char *expected_secret = g_server->websocket_service_secret;
+            const char *expected_secret = shard->server->websocket_service_secret;
             char buf[256];
             int len = lws_hdr_copy(wsi, buf, sizeof(buf), WSI_TOKEN_HTTP_AUTHORIZATION);
             if (len <= 0 || !expected_secret || strcmp(buf, expected_secret) != 0) {
@@ -95,53 +544,56 @@ static int callback_ws(IN struct lws *wsi, IN enum lws_callback_reasons reason,
         }
 
         case LWS_CALLBACK_ESTABLISHED:
-            pss->ring = lws_ring_create(sizeof(msg_t), WEBSOCKET_SERVER_RING_SIZE, destroy_message);
-            pss->tail = 0;
-            pss->wsi = wsi;
-            append_client(pss);
-            break;
-
-        case LWS_CALLBACK_SERVER_WRITEABLE: {
-            if (!pss->ring) {
-                break;
+            if (filter_from_args(shard, pss, wsi) != 0) {
+                return -1;
             }
-            pmsg = lws_ring_get_element(pss->ring, &pss->tail);
-            if (!pmsg) {
-                break;
+            if (fanout_attach(shard, pss, wsi) != 0) {
+                LOG_ERROR("%s", "Failed to allocate session queue");
+                filter_destroy(&shard->filters, pss->filter);
+                pss->filter = NULL;
+                return -1;
             }
+            select_format(pss, wsi);
+            subscribe_from_path(shard, pss, wsi);
+            resume_from_args(shard, pss, wsi);
+            negotiate_deflate(shard, pss, wsi);
+            break;
 
-            m = lws_write(wsi,
-                              (unsigned char *)pmsg->payload + LWS_PRE,
-                              pmsg->len,
-                              LWS_WRITE_TEXT);
-            if (m < (int)pmsg->len) {
-                LOG_WARN("%s", "Short write on WebSocket");
-            }
-            lws_ring_consume_single_tail(pss->ring, &pss->tail, WEBSOCKET_SINGLE_TAIL);
-            if (lws_ring_get_element(pss->ring, &pss->tail)) {
-                lws_callback_on_writable(wsi);
+        case LWS_CALLBACK_SERVER_WRITEABLE:
+            if (write_session(shard, pss) != 0) {
+                return -1;
             }
             break;
-        }
 
-        case LWS_CALLBACK_RECEIVE:   
-            if (!g_server || !in || len == 0) {
+        case LWS_CALLBACK_RECEIVE: {
+            payload_t *payload = NULL;
+            if (reassemble(shard, pss, wsi, in, len, &payload) != 0) {
+                return -1;
+            }
+            if (!payload) {
                 break;
             }
-        
-            broadcast_to_clients((const char *)in, len);
-            if (!g_server && g_server->producer_queue) {
-                if (!message_queue_push(g_server->producer_queue, (const char *)in, len)) {
-                    LOG_WARN("%s", "Failed to forward message to Kafka producer queue");
+            if (!message_queue_try_push_payload(shard->server->broadcast_queue, payload_retain(payload))) {
+                payload_release(payload);
+                metrics_add(METRIC_BROADCAST_QUEUE_DROPS, 1);
+                LOG_WARN("%s", "Dropping client broadcast; dispatcher queue full");
+            }
+            if (shard->server->producer_queue) {
+                if (!message_queue_try_push_payload(shard->server->producer_queue, payload_retain(payload))) {
+                    payload_release(payload);
+                    spill_message(shard->server, payload);
                 }
+                pause_reads(shard, pss);
             }
+            payload_release(payload);
             break;
+        }
+
+        case LWS_CALLBACK_HTTP:
+            return serve_http(wsi, (const char *)in);
 
         case LWS_CALLBACK_CLOSED:
-            remove_client(pss);
-            if (pss->ring) {
-                lws_ring_destroy(pss->ring);
-            }
+            close_session(shard, pss);
             break;
 
         default:
@@ -152,68 +604,266 @@ static int callback_ws(IN struct lws *wsi, IN enum lws_callback_reasons reason,
 
 static const struct lws_protocols protocols[] = {
     {
-        .name = "lootopia-ws",
+        .name = WEBSOCKET_PROTOCOL_TEXT,
+        .callback = callback_ws,
+        .per_session_data_size = sizeof(session_t)
+    },
+    {
+        .name = WEBSOCKET_PROTOCOL_BINARY,
+        .callback = callback_ws,
+        .per_session_data_size = sizeof(session_t)
+    },
+    {
+        .name = WEBSOCKET_PROTOCOL_ENVELOPE,
         .callback = callback_ws,
         .per_session_data_size = sizeof(session_t)
     },
     LWS_PROTOCOL_LIST_TERM
 };
 
+static const struct lws_extension extensions[] = {
+    {WEBSOCKET_DEFLATE_EXTENSION, lws_extension_callback_pm_deflate, WEBSOCKET_DEFLATE_OFFER},
+    {NULL, NULL, NULL}
+};
+
+static void parse_limits(IN const config_t *cfg, OUT backlog_limits_t *limits) {
+    const char *policy = cfg->websocket_slow_consumer_policy;
+
+    limits->policy = SLOW_CONSUMER_DROP_NEWEST;
+    if (policy && strcmp(policy, WEBSOCKET_POLICY_DROP_OLDEST) == 0) {
+        limits->policy = SLOW_CONSUMER_DROP_OLDEST;
+    } else if (policy && strcmp(policy, WEBSOCKET_POLICY_DISCONNECT) == 0) {
+        limits->policy = SLOW_CONSUMER_DISCONNECT;
+    } else if (policy && strcmp(policy, WEBSOCKET_POLICY_CONFLATE) == 0) {
+        limits->policy = SLOW_CONSUMER_CONFLATE;
+    } else if (policy && policy[0] && strcmp(policy, WEBSOCKET_POLICY_DROP_NEWEST) != 0) {
+        LOG_WARN("Unknown slow consumer policy %s; using %s", policy, WEBSOCKET_POLICY_DROP_NEWEST);
+    }
+    limits->session_max_messages = cfg->websocket_session_max_messages > 0
+                                       ? (uint32_t)cfg->websocket_session_max_messages
+                                       : WEBSOCKET_SERVER_RING_SIZE;
+    limits->session_max_bytes = cfg->websocket_session_max_bytes > 0
+                                    ? (size_t)cfg->websocket_session_max_bytes : 0;
+    limits->global_max_bytes = cfg->websocket_global_max_bytes > 0
+                                   ? (size_t)cfg->websocket_global_max_bytes : 0;
+    limits->grace_ms = cfg->websocket_slow_consumer_grace_ms > 0
+                           ? (uint64_t)cfg->websocket_slow_consumer_grace_ms : 0;
+}
+
+static void parse_write_options(IN const config_t *cfg, OUT write_options_t *write) {
+    const char *batch = cfg->websocket_write_batch;
+
+    write->batch = WRITE_BATCH_NONE;
+    if (batch && strcmp(batch, WEBSOCKET_BATCH_JSON) == 0) {
+        write->batch = WRITE_BATCH_JSON;
+    } else if (batch && strcmp(batch, WEBSOCKET_BATCH_BINARY) == 0) {
+        write->batch = WRITE_BATCH_BINARY;
+    } else if (batch && batch[0]) {
+        LOG_WARN("Unknown write batch mode %s; sending one frame per message", batch);
+    }
+    write->budget = cfg->websocket_write_budget > 0 ? (size_t)cfg->websocket_write_budget
+                                                    : WEBSOCKET_WRITE_BUDGET;
+}
+
+static void parse_deflate_options(IN const config_t *cfg, OUT deflate_options_t *deflate) {
+    int level = cfg->websocket_deflate_level;
+
+    deflate->enabled = level > 0;
+    deflate->level = level > WEBSOCKET_DEFLATE_MAX_LEVEL ? WEBSOCKET_DEFLATE_MAX_LEVEL : level;
+    deflate->min_bytes = cfg->websocket_deflate_min_bytes > 0 ? (size_t)cfg->websocket_deflate_min_bytes
+                                                              : WEBSOCKET_DEFLATE_MIN_BYTES;
+}
+
+static void parse_ingress_limits(IN const config_t *cfg,
+                                 IN message_queue_t *producer_queue,
+                                 OUT ingress_limits_t *ingress) {
+    size_t capacity = producer_queue ? producer_queue->capacity : 0;
+    int pause = cfg->websocket_ingress_pause_watermark > 0 ? cfg->websocket_ingress_pause_watermark
+                                                           : WEBSOCKET_INGRESS_PAUSE_PERCENT;
+    int resume = cfg->websocket_ingress_resume_watermark > 0 ? cfg->websocket_ingress_resume_watermark
+                                                             : WEBSOCKET_INGRESS_RESUME_PERCENT;
+
+    if (pause > WEBSOCKET_PERCENT) {
+        pause = WEBSOCKET_PERCENT;
+    }
+    if (resume >= pause) {
+        resume = pause / 2;
+    }
+    ingress->pause_at = capacity * (size_t)pause / WEBSOCKET_PERCENT;
+    ingress->resume_at = capacity * (size_t)resume / WEBSOCKET_PERCENT;
+}
+
+static int create_shard(IN websocket_server_t *server,
+                        IN ws_shard_t *shard,
+                        IN const config_t *cfg,
+                        IN int index) {
+    struct lws_context_creation_info info;
+    char name[METRICS_QUEUE_NAME_LEN];
+
+    shard->server = server;
+    shard->index = index;
+    if (channel_index_init(&shard->channels) != 0) {
+        LOG_ERROR("Failed to create channel index for shard %d", index);
+        return -1;
+    }
+    shard->inbox = message_queue_create((size_t)cfg->message_queue_capacity, MESSAGE_QUEUE_SPSC);
+    if (!shard->inbox) {
+        LOG_ERROR("Failed to create inbox for shard %d", index);
+        return -1;
+    }
+    size_t replay = cfg->websocket_replay_messages > 0 ? (size_t)cfg->websocket_replay_messages
+                  : cfg->websocket_replay_messages == 0 ? WEBSOCKET_REPLAY_MESSAGES : 0;
+    if (replay_ring_init(&shard->replay, replay) != 0) {
+        LOG_ERROR("Failed to create replay ring for shard %d", index);
+        return -1;
+    }
+
+    if (server->deflate.enabled &&
+        deflate_frame_init(&shard->deflate, server->deflate.level, server->deflate.min_bytes) != 0) {
+        LOG_WARN("Failed to create deflate stream for shard %d; compressing per connection", index);
+    }
+
+    memset(&info, 0, sizeof(info));
+    info.port = cfg->port;
+    info.iface = cfg->interface;
+    info.protocols = protocols;
+    info.extensions = server->deflate.enabled ? extensions : NULL;
+    info.gid = -1;
+    info.uid = -1;
+    info.options = LWS_SERVER_OPTION_VALIDATE_UTF8 | LWS_SERVER_OPTION_DISABLE_IPV6;
+    if (server->shard_count > 1) {
+        info.options |= LWS_SERVER_OPTION_ALLOW_LISTEN_SHARE;
+    }
+    info.user = shard;
+
+    shard->context = lws_create_context(&info);
+    if (!shard->context) {
+        LOG_ERROR("Failed to create WebSocket context for shard %d", index);
+        return -1;
+    }
+    message_queue_set_notify(shard->inbox, wake_shard, shard);
+    snprintf(name, sizeof(name), "shard%d_inbox", index);
+    metrics_register_queue(name, shard->inbox);
+    return 0;
+}
+
+static void *shard_thread(IN void *arg) {
+    ws_shard_t *shard = (ws_shard_t *)arg;
+
+    drain_inbox(shard);
+    while (*shard->server->running) {
+        if (lws_service(shard->context, WEBSOCKET_SERVICE_WAIT) < 0) {
+            break;
+        }
+    }
+    return NULL;
+}
+
 websocket_server_t *websocket_server_create(IN const config_t *cfg,
                                             IN message_queue_t *consumer_queue,
                                             IN message_queue_t *producer_queue,
+                                            IN spill_log_t *spill,
                                             IN volatile sig_atomic_t *running_flag) {
     websocket_server_t *server = calloc(1, sizeof(websocket_server_t));
-    struct lws_context_creation_info info;
     if (!server) {
         return NULL;
     }
     server->consumer_queue = consumer_queue;
     server->producer_queue = producer_queue;
+    server->spill = spill;
     server->running = running_flag;
     server->port = cfg->port;
     server->websocket_service_secret = cfg->websocket_service_secret;
-    pthread_mutex_init(&server->clients_lock, NULL);
-
-    memset(&info, 0, sizeof(info));
-    info.port = cfg->port;
-    info.iface = cfg->interface;
-    info.protocols = protocols;
-    info.gid = -1;
-    info.uid = -1;
-    info.options = LWS_SERVER_OPTION_VALIDATE_UTF8 | LWS_SERVER_OPTION_DISABLE_IPV6;
-    info.user = server;
-
-    server->context = lws_create_context(&info);
-    if (!server->context) {
-        LOG_ERROR("%s", "Failed to create WebSocket context");
-        pthread_mutex_destroy(&server->clients_lock);
+    server->protocol = &protocols[0];
+    parse_limits(cfg, &server->limits);
+    parse_write_options(cfg, &server->write);
+    parse_ingress_limits(cfg, producer_queue, &server->ingress);
+    parse_deflate_options(cfg, &server->deflate);
+    server->max_message_bytes = cfg->websocket_max_message_bytes > 0 ? (size_t)cfg->websocket_max_message_bytes
+                                                                      : WEBSOCKET_MAX_MESSAGE_BYTES;
+    atomic_init(&server->queued_bytes, 0);
+    atomic_init(&server->next_seq, 0);
+    server->epoch = metrics_wall_ms();
+    server->broadcast_queue = message_queue_create((size_t)cfg->message_queue_capacity, MESSAGE_QUEUE_MPSC);
+    if (!server->broadcast_queue) {
+        free(server);
+        return NULL;
+    }
+    metrics_register_queue("broadcast", server->broadcast_queue);
+    server->shard_count = cfg->websocket_service_threads > 0 ? cfg->websocket_service_threads
+                                                             : WEBSOCKET_DEFAULT_SHARDS;
+    server->shards = calloc((size_t)server->shard_count, sizeof(ws_shard_t));
+    if (!server->shards) {
+        metrics_unregister_queue(server->broadcast_queue);
+        message_queue_destroy(server->broadcast_queue);
         free(server);
         return NULL;
     }
 
-    server->protocol = &protocols[0];
-    g_server = server;
+    for (int i = 0; i < server->shard_count; i++) {
+        if (create_shard(server, &server->shards[i], cfg, i) != 0) {
+            websocket_server_destroy(server);
+            return NULL;
+        }
+    }
+
+    for (int i = 0; i < server->shard_count; i++) {
+        ws_shard_t *shard = &server->shards[i];
+        if (pthread_create(&shard->thread, NULL, shard_thread, shard) != 0) {
+            LOG_ERROR("Failed to start WebSocket service thread %d", i);
+            websocket_server_stop(server);
+            websocket_server_destroy(server);
+            return NULL;
+        }
+        shard->started = true;
+    }
     return server;
 }
 
 int websocket_server_run(IN websocket_server_t *server) {
-    size_t len = 0;
-    char *payload = NULL;
-    
+    payload_t *payload = NULL;
+    struct pollfd pfds[2];
+    sigset_t signals;
+    sigset_t wait_mask;
+
     if (!server) {
         return -1;
     }
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, &wait_mask);
+    sigdelset(&wait_mask, SIGINT);
+    sigdelset(&wait_mask, SIGTERM);
 
-    LOG_INFO("WebSocket server listening on %d", server->port);
+    LOG_INFO("WebSocket server listening on %d with %d service threads",
+             server->port, server->shard_count);
 
+    pfds[0].fd = message_queue_event_fd(server->consumer_queue);
+    pfds[1].fd = message_queue_event_fd(server->broadcast_queue);
+    pfds[0].events = pfds[1].events = POLLIN;
     while (*server->running) {
-        while (message_queue_try_pop(server->consumer_queue, &payload, &len)) {
-            broadcast_to_clients(payload, len);
-            free(payload);
-        }
-        lws_service(server->context, WEBSOCKET_SINGLE_TAIL);
+        bool drained;
+        message_queue_clear_wakeup(server->consumer_queue);
+        message_queue_clear_wakeup(server->broadcast_queue);
+        do {
+            drained = false;
+            if (message_queue_try_pop(server->broadcast_queue, &payload)) {
+                post_to_shards(server, payload, false);
+                payload_release(payload);
+                drained = true;
+            }
+            if (message_queue_try_pop(server->consumer_queue, &payload)) {
+                metrics_record_since(METRIC_LATENCY_CONSUMER_QUEUE, payload->ingress_us, metrics_now_us());
+                post_to_shards(server, payload, true);
+                payload_release(payload);
+                drained = true;
+            }
+        } while (drained);
+        ppoll(pfds, 2, NULL, &wait_mask);
     }
+    pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
+    websocket_server_stop(server);
     return 0;
 }
 
@@ -222,26 +872,37 @@ void websocket_server_stop(IN websocket_server_t *server) {
         return;
     }
     *server->running = 0;
+    for (int i = 0; i < server->shard_count; i++) {
+        if (server->shards[i].context) {
+            lws_cancel_service(server->shards[i].context);
+        }
+    }
 }
 
 void websocket_server_destroy(IN websocket_server_t *server) {
     if (!server) {
         return;
     }
-    pthread_mutex_lock(&server->clients_lock);
-    session_t *pss = server->clients;
-    session_t *next;
-    while (pss) {
-        next = pss->next;
-        if (pss->ring) {
-            lws_ring_destroy(pss->ring);
+    for (int i = 0; i < server->shard_count; i++) {
+        ws_shard_t *shard = &server->shards[i];
+        if (shard->started) {
+            lws_cancel_service(shard->context);
+            pthread_join(shard->thread, NULL);
+        }
+        if (shard->context) {
+            lws_context_destroy(shard->context);
         }
-        pss = next;
+        metrics_unregister_queue(shard->inbox);
+        message_queue_destroy(shard->inbox);
+        channel_index_destroy(&shard->channels);
+        replay_ring_destroy(&shard->replay);
+        deflate_frame_destroy(&shard->deflate);
+        free(shard->write_buffer);
     }
-    pthread_mutex_unlock(&server->clients_lock);
-    lws_context_destroy(server->context);
-    pthread_mutex_destroy(&server->clients_lock);
+    if (server->broadcast_queue) {
+        metrics_unregister_queue(server->broadcast_queue);
+        message_queue_destroy(server->broadcast_queue);
+    }
+    free(server->shards);
     free(server);
-    g_server = NULL;
 }
-